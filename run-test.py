@@ -1,11 +1,14 @@
 #!/usr/bin/env python3
 
-import sys, os, time
+import sys, os, time, struct
 
 batch_args = "-b ../input/baboon.png ../input/balloons.png ../input/bigbrain.png ../input/bird.png ../input/bottle.png ../input/bowtie.png ../input/c.png ../input/chair.png ../input/darkknight.png ../input/darknight.png ../input/dollar.png ../input/flag.png ../input/guitar.png ../input/house.png ../input/knight.png ../input/night.png ../input/ocean.png ../input/oski.png ../input/playground.png ../input/rainbow.png ../input/silver.png ../input/smile.png ../input/snorlax.png ../input/square.png ../input/stool.png ../input/sword.png ../input/tree.png ../input/valve.png ../input/wallet.png ../input/weaver.png"
 
 view_args = "-v ../input/flag.png"
 
+# An RGB input, whose PNG rows are three times wider than the image
+formats_input = "wallet.png"
+
 naive_time = 1
 student_time = 1
 
@@ -21,6 +24,8 @@ def main(mode):
 	elif mode == 'correctness':
 		run_student(False)
 		check_correctness()
+	elif mode == 'formats':
+		check_formats()
 	else:
 		print ("Unknown mode specified to run")
 
@@ -51,6 +56,52 @@ def run_view():
 def check_correctness():
 	os.system("./check-correctness")
 
+def png_size(path):
+	with open(path, "rb") as f:
+		return struct.unpack(">II", f.read(24)[16:24])
+
+def pnm_image(path):
+	with open(path, "rb") as f:
+		data = f.read()
+	fields = data.split(maxsplit=4 if data[:2] == b"P5" else 3)
+	width, height = int(fields[1]), int(fields[2])
+	pixels = data[len(data) - (height * width if data[:2] == b"P5" else height * ((width + 7) // 8)):]
+	if data[:2] == b"P5":
+		rows = [pixels[j * width:(j + 1) * width] for j in range(height)]
+	else:
+		stride = (width + 7) // 8
+		rows = [bytes(0 if pixels[j * stride + i // 8] & (0x80 >> (i % 8)) else 255 for i in range(width)) for j in range(height)]
+	return width, height, rows
+
+def raw_image(path):
+	with open(path, "rb") as f:
+		data = f.read()
+	width, height, stride = struct.unpack("=III", data[8:20])
+	pixels = data[64:]
+	if data[:8] == b"CEDRAW8\n":
+		rows = [pixels[j * stride:j * stride + width] for j in range(height)]
+	else:
+		rows = [bytes(255 if pixels[j * stride + i // 8] & (1 << (i % 8)) else 0 for i in range(width)) for j in range(height)]
+	return width, height, rows
+
+def check_formats():
+	size = png_size("input/" + formats_input)
+	name = formats_input[:-4]
+	images = {}
+	for extension in ["pgm", "pbm", "raw", "mask"]:
+		dst = "out/{}.{}".format(name, extension)
+		os.system("cd student; ./ced -o {} ../input/{}".format(dst, formats_input))
+		read = pnm_image if extension in ["pgm", "pbm"] else raw_image
+		width, height, rows = read("student/" + dst)
+		if (width, height) != size:
+			print ("Formats Check Failed: {} is {}x{} instead of {}x{}".format(dst, width, height, size[0], size[1]))
+			return
+		images[extension] = rows
+	if any(rows != images["pgm"] for rows in images.values()):
+		print ("Formats Check Failed: the formats hold different edges")
+		return
+	print ("Formats Check Successful")
+
 if __name__ == '__main__':
 	if len(sys.argv) != 2:
 		print ("Wrong input number. Need exactly 1 input")
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <omp.h>
+#include <png.h>
+#include <x86intrin.h>
+#include "arena.h"
+
+/*
+	Arenas replace the allocations the stages used to make for every image. The images
+	of a job live in the arena of the job and the scratch buffers of a step live in the
+	arena of the thread running it, which every thread (the OpenMP threads and the
+	threads of the batch pipeline) gets the first time it asks. Both are only emptied,
+	never freed, between images.
+*/
+
+static __thread struct arena scratch;
+static __thread jmp_buf *recovery = NULL;
+static __thread int recovery_level = 0;
+
+
+/*
+	Returns bytes of uninitialized memory aligned to ARENA_ALIGNMENT.
+*/
+void *arena_alloc(struct arena *arena, size_t bytes) {
+	bytes = (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+	const size_t position = arena->used;
+	const size_t peak = arena->peak;
+	arena->used += bytes;
+	if (arena->used > arena->peak) {
+		arena->peak = arena->used;
+	}
+	if (arena->overflow == NULL && arena->used <= arena->size) {
+		return arena->block + position;
+	}
+	struct arena_chunk *chunk = _mm_malloc(ARENA_ALIGNMENT + bytes, ARENA_ALIGNMENT);
+	if (chunk == NULL) {
+		arena->used = position;
+		arena->peak = peak;
+		arena_failure("Failed to allocate space for the arena.");
+	}
+	chunk->next = arena->overflow;
+	chunk->position = position;
+	arena->overflow = chunk;
+	return (unsigned char *) chunk + ARENA_ALIGNMENT;
+}
+
+
+/*
+	Returns bytes of zeroed memory aligned to ARENA_ALIGNMENT.
+*/
+void *arena_calloc(struct arena *arena, size_t bytes) {
+	void *memory = arena_alloc(arena, bytes);
+	memset(memory, 0, bytes);
+	return memory;
+}
+
+
+/*
+	Returns the point to give to arena_release to free everything allocated after now.
+*/
+size_t arena_mark(struct arena *arena) {
+	return arena->used;
+}
+
+
+/*
+	Frees everything allocated since mark was taken. Releasing to 0 empties the arena,
+	which is when the block grows to the peak if anything had to go into chunks. A
+	release never fails: if there is no memory for the larger block, the arena is left
+	without one and the next allocations go into chunks again, which report the failure
+	where it can be recovered from.
+*/
+void arena_release(struct arena *arena, size_t mark) {
+	arena->used = mark;
+	while (arena->overflow != NULL && arena->overflow->position >= mark) {
+		struct arena_chunk *next = arena->overflow->next;
+		_mm_free(arena->overflow);
+		arena->overflow = next;
+	}
+	if (mark > 0 || arena->size >= arena->peak) {
+		return;
+	}
+	_mm_free(arena->block);
+	arena->block = _mm_malloc(arena->peak, ARENA_ALIGNMENT);
+	arena->size = arena->block != NULL ? arena->peak : 0;
+}
+
+
+/*
+	Frees all the memory of an arena and leaves it empty.
+*/
+void arena_destroy(struct arena *arena) {
+	while (arena->overflow != NULL) {
+		struct arena_chunk *next = arena->overflow->next;
+		_mm_free(arena->overflow);
+		arena->overflow = next;
+	}
+	_mm_free(arena->block);
+	memset(arena, 0, sizeof(struct arena));
+}
+
+
+/*
+	Makes running out of memory or failing to read or write an image on the calling
+	thread longjmp to jump instead of ending the program, until it is called again with
+	NULL. An arena is left as it was before the allocation that failed. The OpenMP
+	nesting level of the call is kept, so a caller that is itself inside a parallel
+	region can recover too.
+*/
+void arena_recover(jmp_buf *jump) {
+	recovery = jump;
+	recovery_level = omp_get_level();
+}
+
+
+/*
+	Ends the program with message after an allocation or an image failed, unless
+	arena_recover gave the calling thread somewhere to go. Failures inside a parallel
+	region started after arena_recover always end it since a longjmp cannot leave one.
+*/
+void arena_failure(const char *message) {
+	if (recovery != NULL && omp_get_level() == recovery_level) {
+		longjmp(*recovery, 1);
+	}
+	fprintf(stderr, "%s\n", message);
+	exit(1);
+}
+
+
+/*
+	Returns the scratch arena of the calling thread.
+*/
+struct arena *thread_arena(void) {
+	return &scratch;
+}
+
+
+/*
+	Allocation callbacks that let PNG_LIB take its memory from the arena given as the
+	mem_ptr of png_create_read_struct_2 and png_create_write_struct_2. Nothing is freed
+	on its own since the whole arena is emptied once the image is done.
+*/
+png_voidp arena_png_malloc(png_structp png_ptr, png_alloc_size_t bytes) {
+	return arena_alloc(png_get_mem_ptr(png_ptr), bytes);
+}
+
+void arena_png_free(png_structp png_ptr, png_voidp memory) {
+}
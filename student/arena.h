@@ -0,0 +1,48 @@
+/*
+	Every block handed out by an arena starts on this many bytes.
+*/
+#define ARENA_ALIGNMENT 64
+
+/*
+	A block an arena had to allocate on its own because its main block was full.
+	position is where the chunk starts among everything the arena holds.
+*/
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t position;
+};
+
+/*
+	Grow-only bump allocator. Memory is taken from block in order and given back in
+	the reverse order with arena_release. Once an allocation does not fit, it and the
+	ones after it go into separate chunks that are freed when they are released, and
+	when the arena is empty again block is grown to the most it held at once, so after
+	the largest workload it never allocates.
+*/
+struct arena {
+	unsigned char *block;
+	size_t size;
+	size_t used;
+	size_t peak;
+	struct arena_chunk *overflow;
+};
+
+void *arena_alloc(struct arena *, size_t);
+
+void *arena_calloc(struct arena *, size_t);
+
+size_t arena_mark(struct arena *);
+
+void arena_release(struct arena *, size_t);
+
+void arena_destroy(struct arena *);
+
+void arena_recover(jmp_buf *);
+
+void arena_failure(const char *);
+
+struct arena *thread_arena(void);
+
+png_voidp arena_png_malloc(png_structp, png_alloc_size_t);
+
+void arena_png_free(png_structp, png_voidp);
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <png.h>
+#include "arena.h"
+#include "ced.h"
+#include "canny.h"
+#include "student.h"
+#include "simd.h"
+#include "image_io.h"
+
+/*
+	The library runs compute_image, the same second stage the program runs between
+	decoding and encoding a file, on a job whose input is a view of the caller's pixels.
+	Nothing here reads or writes a file or goes through PNG_LIB, and a failed allocation
+	comes back as CANNY_OUT_OF_MEMORY through arena_recover instead of ending the
+	process. That works because every step of compute_image allocates what its OpenMP
+	threads need on the calling thread before its parallel regions start.
+*/
+
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+
+/*
+	Returns a context with one job and no memory yet, or NULL if there is no memory for
+	it.
+*/
+struct canny_context *canny_context_create(void) {
+	pthread_once(&simd_once, simd_init);
+	struct canny_context *context = calloc(1, sizeof(struct canny_context));
+	if (context == NULL) {
+		return NULL;
+	}
+	context->jobs = calloc(1, sizeof(struct canny_job));
+	if (context->jobs == NULL) {
+		free(context);
+		return NULL;
+	}
+	context->count = 1;
+	return context;
+}
+
+
+/*
+	Frees a context made by canny_context_create. The scratch arenas of the threads that
+	ran it are kept for the next context they run.
+*/
+void canny_context_destroy(struct canny_context *context) {
+	if (context == NULL) {
+		return;
+	}
+	arena_destroy(&context->jobs[0].arena);
+	free(context->jobs);
+	free(context);
+}
+
+
+/*
+	Finds the edges of the width by height grayscale image at gray and writes them to
+	out, 255 for an edge and 0 elsewhere. Rows of both start stride bytes apart and only
+	the first width bytes of a row of out are written. params may be NULL for the
+	settings of the program and context may be NULL for a context that only lasts this
+	call. Returns CANNY_INVALID_ARGUMENT without touching out if the arguments cannot be
+	run.
+*/
+enum canny_status canny(const uint8_t *gray, const size_t stride, const unsigned width, const unsigned height, const struct canny_params *params, uint8_t *out, struct canny_context *context) {
+	static const struct canny_params defaults = {.99, 105, 45};
+	if (params == NULL) {
+		params = &defaults;
+	}
+	if (gray == NULL || out == NULL || width == 0 || height == 0 || stride < width || stride > UINT32_MAX || (uint64_t) width * height > UINT32_MAX) {
+		return CANNY_INVALID_ARGUMENT;
+	}
+	if (!(params->sigma >= CANNY_MIN_SIGMA && params->sigma <= CANNY_MAX_SIGMA) || params->low > params->high || params->high > MAX_BRIGHTNESS) {
+		return CANNY_INVALID_ARGUMENT;
+	}
+	struct canny_context *const temporary = context == NULL ? canny_context_create() : NULL;
+	if (context == NULL && temporary == NULL) {
+		return CANNY_OUT_OF_MEMORY;
+	}
+	struct canny_job *const job = context != NULL ? &context->jobs[0] : &temporary->jobs[0];
+	struct arena *const scratch = thread_arena();
+	const size_t mark = arena_mark(scratch);
+
+	jmp_buf jump;
+	if (setjmp(jump)) {
+		arena_recover(NULL);
+		arena_release(scratch, mark);
+		arena_release(&job->arena, 0);
+		canny_context_destroy(temporary);
+		return CANNY_OUT_OF_MEMORY;
+	}
+	arena_recover(&jump);
+
+	arena_release(&job->arena, 0);
+	job->params = *params;
+	job->streamed = false;
+	job->crop.width = 0;
+
+	//The input is only read, so it is used where the caller keeps it
+	struct image_header header = {width, height, stride, 0};
+	read_view((png_bytep) gray, &header, &job->input, &job->arena);
+	compute_image(job);
+	for (unsigned row = 0; row < height; row++) {
+		memcpy(out + row * stride, job->output.rows[row], width);
+	}
+
+	arena_recover(NULL);
+	canny_context_destroy(temporary);
+	return CANNY_OK;
+}
+
+
+/*
+	Returns a description of status for messages.
+*/
+const char *canny_status_string(const enum canny_status status) {
+	switch (status) {
+		case CANNY_OK:
+			return "success";
+		case CANNY_INVALID_ARGUMENT:
+			return "invalid argument";
+		case CANNY_OUT_OF_MEMORY:
+			return "out of memory";
+	}
+	return "unknown status";
+}
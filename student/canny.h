@@ -0,0 +1,60 @@
+/*
+	In memory interface of the edge detector, built into student/lib/libcanny.a and
+	student/lib/libcanny.so by make build-library. It runs the same algorithm as the
+	program on an 8-bit grayscale image the caller already holds, without files,
+	PNG_LIB or exiting on errors. Unlike the headers of the program it includes what it
+	needs, so it can be used on its own.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+	Marks the functions the library exports. Everything else in it is built hidden and
+	localized, so the internals of the program cannot clash with the symbols of the
+	program that links it.
+*/
+#define CANNY_API __attribute__((visibility("default")))
+
+/*
+	Range of sigmas a run can ask for. Below it the largest weight of the smallest
+	kernel overflows a float, and above it the largest kernel is already flat.
+*/
+#define CANNY_MIN_SIGMA 0.25
+#define CANNY_MAX_SIGMA 16.0
+
+/*
+	Parameters of one run of the algorithm: the sigma of the gaussian filter and the
+	high and low thresholds of hysteresis. sigma has to be within CANNY_MIN_SIGMA and
+	CANNY_MAX_SIGMA and the thresholds at most 255. The program uses .99, 105 and 45.
+*/
+struct canny_params {
+	float sigma;
+	unsigned high;
+	unsigned low;
+};
+
+/*
+	What canny returns. CANNY_OUT_OF_MEMORY leaves the context usable for the next
+	image.
+*/
+enum canny_status {
+	CANNY_OK,
+	CANNY_INVALID_ARGUMENT,
+	CANNY_OUT_OF_MEMORY
+};
+
+/*
+	Memory a caller keeps from one image to the next. Once it has seen the largest
+	image a context is used for, later images do not allocate. A context must not be
+	used by two calls at the same time.
+*/
+struct canny_context;
+
+CANNY_API struct canny_context *canny_context_create(void);
+
+CANNY_API void canny_context_destroy(struct canny_context *);
+
+CANNY_API enum canny_status canny(const uint8_t *, const size_t, const unsigned, const unsigned, const struct canny_params *, uint8_t *, struct canny_context *);
+
+CANNY_API const char *canny_status_string(const enum canny_status);
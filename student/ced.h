@@ -1,14 +1,105 @@
 #define MAX_BRIGHTNESS 255
 #define M_PI 3.14159265358979323846264338327
 
-void setup_read(FILE *, FILE *, png_structp *, png_infop *, png_infop *);
+/*
+	How setup_write compresses the output. ENCODE_DEFAULT keeps the settings of PNG_LIB,
+	ENCODE_FAST spends as little time as possible on the mostly black edge maps and
+	ENCODE_SMALL as much as it takes to make the file small, which includes writing it
+	the way of ENCODE_FAST too and keeping the smaller of the two.
+*/
+enum encode_profile {
+	ENCODE_DEFAULT,
+	ENCODE_FAST,
+	ENCODE_SMALL
+};
+
+/*
+	Formats of the files read and written, picked by the extension of their names with
+	image_format. Anything without one of the extensions of image_backends is PNG.
+*/
+enum image_format {
+	FORMAT_PNG,
+	FORMAT_RAW,
+	FORMAT_PGM,
+	FORMAT_PBM,
+	FORMAT_MASK,
+	IMAGE_FORMATS
+};
+
+/*
+	A source file mapped into memory, which PNG_LIB reads from offset on. data is NULL
+	when the file could not be mapped and has to be read through stdio.
+*/
+struct mapped_file {
+	png_bytep data;
+	size_t size;
+	size_t offset;
+};
+
+/*
+	Size of the first block of a memory_file.
+*/
+#define MEMORY_BLOCK_SIZE (1 << 16)
+
+/*
+	One block of a memory_file, followed by the size bytes it holds, of which the first
+	used are written.
+*/
+struct memory_block {
+	struct memory_block *next;
+	size_t size;
+	size_t used;
+};
+
+/*
+	A file kept in memory, such as one PNG_LIB writes through write_memory. It is a list
+	of blocks from arena, each twice the size of the one before, so it grows without
+	moving what it already holds and is freed with the arena. size is the number of
+	bytes in all of them.
+*/
+struct memory_file {
+	struct memory_block *first;
+	struct memory_block *last;
+	size_t size;
+	struct arena *arena;
+};
+
+void setup_read(FILE *, FILE *, png_structp *, png_infop *, png_infop *, struct arena *, struct mapped_file *);
+
+void map_file(FILE *, struct mapped_file *);
+
+void unmap_file(struct mapped_file *);
+
+void read_mapped(png_structp, png_bytep, png_size_t);
+
+void png_read_failure(png_structp, png_const_charp);
+
+void png_write_failure(png_structp, png_const_charp);
 
 void setup_info(png_structp, png_infop);
 
 void execute_read(png_structp, png_infop, png_infop, png_bytep*);
 
-void setup_write(FILE *, FILE *, png_structp, png_infop, png_infop, png_structp *, png_infop *);
+void setup_write(FILE *, FILE *, png_structp, png_infop, png_infop, png_structp *, png_infop *, struct arena *, const enum encode_profile, const bool);
+
+void set_encoding(png_structp, const enum encode_profile);
 
 void execute_write(png_structp, png_infop, png_bytep *);
 
+void execute_write_smallest(png_structp, png_infop, png_bytep *, FILE *, struct arena *);
+
+void write_memory(png_structp, png_bytep, png_size_t);
+
+void flush_memory(png_structp);
+
+void append_memory(struct memory_file *, const void *, size_t);
+
+png_bytep reserve_memory(struct memory_file *, size_t *);
+
+void copy_memory(const struct memory_file *, png_bytep);
+
+void save_memory(const struct memory_file *, FILE *);
+
+void execute_write_rows(png_structp, png_infop, png_bytep *, const unsigned);
+
 void cleanup_struct_mem(png_structp, png_infop, png_infop, png_structp, png_infop);
\ No newline at end of file
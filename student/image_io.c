@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <png.h>
+#include "arena.h"
+#include "ced.h"
+#include "canny.h"
+#include "student.h"
+#include "image_io.h"
+
+/*
+	Formats for the images passed between programs, where the inflate and deflate of
+	PNG are pure overhead. Raw and PGM files hold the pixels as they are, so read_image
+	hands the compute stages a view of the mapped file instead of a copy, and writing
+	them is a plain write of every row. PBM and mask files keep one bit per pixel for
+	edge maps, with PBM in the layout other programs read and mask in rows of 64-bit
+	words, see read_mask.
+*/
+
+#define RAW_MAGIC "CEDRAW8\n"
+#define MASK_MAGIC "CEDMASK\n"
+
+/*
+	Largest width or height a PGM or PBM header may give, which keeps the row sizes
+	within an unsigned.
+*/
+#define PNM_MAX_SIZE (1u << 30)
+
+const struct image_backend image_backends[IMAGE_FORMATS] = {
+	{"png", ".png", NULL, NULL, NULL},
+	{"raw", ".raw", parse_raw, read_view, write_raw},
+	{"pgm", ".pgm", parse_pgm, read_view, write_pgm},
+	{"pbm", ".pbm", parse_pbm, read_pbm, write_pbm},
+	{"mask", ".mask", parse_mask, read_mask, write_mask}
+};
+
+
+/*
+	Returns the format of the file name from its extension.
+*/
+enum image_format image_format(const char *name) {
+	const size_t length = strlen(name);
+	for (unsigned format = FORMAT_PNG + 1; format < IMAGE_FORMATS; format++) {
+		const size_t extension = strlen(image_backends[format].extension);
+		if (length > extension && strcmp(name + length - extension, image_backends[format].extension) == 0) {
+			return format;
+		}
+	}
+	return FORMAT_PNG;
+}
+
+
+/*
+	Reads the file in format behind source into image, from the mapping when there is
+	one and otherwise from file, which is read to its end into the arena. The pixels of
+	raw and PGM files are not copied, so image is only valid as long as source stays
+	mapped and must not be written to.
+*/
+void read_image(FILE *file, struct mapped_file *source, const enum image_format format, struct image_buffer *image, struct arena *arena) {
+	const struct image_backend *backend = &image_backends[format];
+	png_bytep data = source->data;
+	size_t size = source->size;
+	if (data == NULL) {
+		data = read_stream(file, &size, arena);
+	}
+	//Errors go through arena_failure so a server can answer them and go on
+	struct image_header header;
+	char message[64];
+	if (!backend->parse(data, size, &header)) {
+		snprintf(message, sizeof(message), "File is not a %s file.", backend->name);
+		arena_failure(message);
+	}
+	if ((size - header.offset) / header.stride < header.height) {
+		snprintf(message, sizeof(message), "The %s file is shorter than its header says.", backend->name);
+		arena_failure(message);
+	}
+	backend->read(data + header.offset, &header, image, arena);
+}
+
+
+/*
+	Writes image to file in format, which is not FORMAT_PNG, with any buffer it needs
+	from arena.
+*/
+void write_image(FILE *file, const enum image_format format, struct image_buffer *image, struct arena *arena) {
+	image_backends[format].write(file, image, arena);
+}
+
+
+/*
+	Returns the number of pixels of a file in format from the first size bytes of it,
+	or 0 if they are not the header of one.
+*/
+size_t probe_image(png_bytep data, const size_t size, const enum image_format format) {
+	struct image_header header;
+	if (!image_backends[format].parse(data, size, &header)) {
+		return 0;
+	}
+	return (size_t) header.width * header.height;
+}
+
+
+/*
+	Reads file to its end into memory from arena, for the files that cannot be mapped,
+	and stores the number of bytes read in size. The file is read into a memory_file
+	in the scratch arena of the thread first, since its size is not known up front.
+*/
+png_bytep read_stream(FILE *file, size_t *size, struct arena *arena) {
+	struct arena *scratch = thread_arena();
+	const size_t mark = arena_mark(scratch);
+	struct memory_file stream = {NULL, NULL, 0, scratch};
+	size_t space, count;
+	do {
+		png_bytep next = reserve_memory(&stream, &space);
+		count = fread(next, 1, space, file);
+		stream.last->used += count;
+		stream.size += count;
+	} while (count == space);
+	png_bytep data = arena_alloc(arena, stream.size);
+	copy_memory(&stream, data);
+	*size = stream.size;
+	arena_release(scratch, mark);
+	return data;
+}
+
+
+/*
+	Header parsers of the raw and mask formats.
+*/
+bool parse_raw(png_bytep data, const size_t size, struct image_header *header) {
+	return parse_raw_header(data, size, RAW_MAGIC, 8, header);
+}
+
+bool parse_mask(png_bytep data, const size_t size, struct image_header *header) {
+	return parse_raw_header(data, size, MASK_MAGIC, 1, header);
+}
+
+
+/*
+	Reads a struct raw_header starting with magic whose rows hold bits bits per
+	pixel. The rows of a mask are made of 64-bit words, so its stride has to keep
+	them aligned.
+*/
+bool parse_raw_header(png_bytep data, const size_t size, const char *magic, const unsigned bits, struct image_header *header) {
+	struct raw_header raw;
+	if (size < RAW_HEADER_SIZE) {
+		return false;
+	}
+	memcpy(&raw, data, sizeof(raw));
+	const uint64_t row_bytes = bits == 1 ? ((uint64_t) raw.width + 63) / 64 * sizeof(uint64_t) : raw.width;
+	if (memcmp(raw.magic, magic, sizeof(raw.magic)) || raw.width == 0 || raw.height == 0 || raw.stride < row_bytes || (bits == 1 && raw.stride % sizeof(uint64_t))) {
+		return false;
+	}
+	header->width = raw.width;
+	header->height = raw.height;
+	header->stride = raw.stride;
+	header->offset = RAW_HEADER_SIZE;
+	return true;
+}
+
+
+/*
+	Header parsers of binary PGM with 8-bit pixels and of binary PBM.
+*/
+bool parse_pgm(png_bytep data, const size_t size, struct image_header *header) {
+	return parse_pnm(data, size, '5', true, header);
+}
+
+bool parse_pbm(png_bytep data, const size_t size, struct image_header *header) {
+	return parse_pnm(data, size, '4', false, header);
+}
+
+
+/*
+	Reads the P<kind> header shared by PGM and PBM: the width, the height and, with
+	has_max, the largest pixel value, separated by whitespace or comments and followed
+	by a single whitespace character before the rows. PGM rows hold a byte and PBM rows
+	a bit per pixel.
+*/
+bool parse_pnm(png_bytep data, const size_t size, const char kind, const bool has_max, struct image_header *header) {
+	size_t offset = 2;
+	unsigned max = MAX_BRIGHTNESS;
+	if (size < 2 || data[0] != 'P' || data[1] != kind) {
+		return false;
+	}
+	if (!pnm_number(data, size, &offset, &header->width) || !pnm_number(data, size, &offset, &header->height) || (has_max && !pnm_number(data, size, &offset, &max))) {
+		return false;
+	}
+	if (header->width == 0 || header->height == 0 || max != MAX_BRIGHTNESS || offset >= size || !isspace(data[offset])) {
+		return false;
+	}
+	header->stride = has_max ? header->width : (header->width + 7) / 8;
+	header->offset = offset + 1;
+	return true;
+}
+
+
+/*
+	Reads the number at offset of a PGM or PBM header, skipping the whitespace and the
+	comments before it, and moves offset past it.
+*/
+bool pnm_number(png_bytep data, const size_t size, size_t *offset, unsigned *value) {
+	while (*offset < size && (isspace(data[*offset]) || data[*offset] == '#')) {
+		if (data[*offset] == '#') {
+			while (*offset < size && data[*offset] != '\n') {
+				(*offset)++;
+			}
+		} else {
+			(*offset)++;
+		}
+	}
+	if (*offset >= size || !isdigit(data[*offset])) {
+		return false;
+	}
+	*value = 0;
+	while (*offset < size && isdigit(data[*offset])) {
+		*value = *value * 10 + data[*offset] - '0';
+		if (*value > PNM_MAX_SIZE) {
+			return false;
+		}
+		(*offset)++;
+	}
+	return true;
+}
+
+
+/*
+	Makes image a view of the 8-bit rows at data, so only the row pointers are
+	allocated.
+*/
+void read_view(png_bytep data, struct image_header *header, struct image_buffer *image, struct arena *arena) {
+	image->data = data;
+	image->width = header->width;
+	image->height = header->height;
+	image->stride = header->stride;
+	image->rows = arena_alloc(arena, image->height * sizeof(png_bytep));
+	for (unsigned row = 0; row < image->height; row++) {
+		image->rows[row] = image->data + (size_t) row * image->stride;
+	}
+}
+
+
+/*
+	Unpacks PBM rows, where the first pixel is the high bit and a set bit is black.
+*/
+void read_pbm(png_bytep data, struct image_header *header, struct image_buffer *image, struct arena *arena) {
+	allocate_image(image, header->width, header->height, arena);
+	for (unsigned j = 0; j < image->height; j++) {
+		png_bytep bits = data + (size_t) j * header->stride;
+		for (unsigned i = 0; i < image->width; i++) {
+			image->rows[j][i] = bits[i / 8] & (0x80 >> (i % 8)) ? 0 : MAX_BRIGHTNESS;
+		}
+	}
+}
+
+
+/*
+	Unpacks mask rows, where pixel i is bit i % 64 of word i / 64 and a set bit is an
+	edge.
+*/
+void read_mask(png_bytep data, struct image_header *header, struct image_buffer *image, struct arena *arena) {
+	allocate_image(image, header->width, header->height, arena);
+	for (unsigned j = 0; j < image->height; j++) {
+		uint64_t *words = (uint64_t *) (data + (size_t) j * header->stride);
+		for (unsigned i = 0; i < image->width; i++) {
+			image->rows[j][i] = words[i / 64] >> (i % 64) & 1 ? MAX_BRIGHTNESS : 0;
+		}
+	}
+}
+
+
+/*
+	Writes the rows of image as they are, padded with zeros to the next multiple of
+	IMAGE_ALIGNMENT.
+*/
+void write_raw(FILE *file, struct image_buffer *image, struct arena *arena) {
+	(void) arena;
+	static const png_byte padding[IMAGE_ALIGNMENT];
+	const unsigned stride = (image->width + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+	write_header(file, RAW_MAGIC, image, stride);
+	for (unsigned j = 0; j < image->height; j++) {
+		write_bytes(file, image->rows[j], image->width);
+		write_bytes(file, padding, stride - image->width);
+	}
+}
+
+
+/*
+	Writes image with one bit per pixel in the layout read_mask reads, a bit for every
+	pixel that is not 0.
+*/
+void write_mask(FILE *file, struct image_buffer *image, struct arena *arena) {
+	const unsigned words = (image->width + 63) / 64;
+	uint64_t *row = arena_alloc(arena, words * sizeof(uint64_t));
+	write_header(file, MASK_MAGIC, image, words * sizeof(uint64_t));
+	for (unsigned j = 0; j < image->height; j++) {
+		memset(row, 0, words * sizeof(uint64_t));
+		for (unsigned i = 0; i < image->width; i++) {
+			row[i / 64] |= (uint64_t) (image->rows[j][i] != 0) << (i % 64);
+		}
+		write_bytes(file, row, words * sizeof(uint64_t));
+	}
+}
+
+
+/*
+	Writes image as a binary PGM.
+*/
+void write_pgm(FILE *file, struct image_buffer *image, struct arena *arena) {
+	(void) arena;
+	fprintf(file, "P5\n%u %u\n%d\n", image->width, image->height, MAX_BRIGHTNESS);
+	for (unsigned j = 0; j < image->height; j++) {
+		write_bytes(file, image->rows[j], image->width);
+	}
+}
+
+
+/*
+	Writes image as a binary PBM, so edges are the white pixels like in the PNG output
+	and everything that is 0 is black.
+*/
+void write_pbm(FILE *file, struct image_buffer *image, struct arena *arena) {
+	const unsigned bytes = (image->width + 7) / 8;
+	png_bytep row = arena_alloc(arena, bytes);
+	fprintf(file, "P4\n%u %u\n", image->width, image->height);
+	for (unsigned j = 0; j < image->height; j++) {
+		memset(row, 0, bytes);
+		for (unsigned i = 0; i < image->width; i++) {
+			row[i / 8] |= (image->rows[j][i] == 0) << (7 - i % 8);
+		}
+		write_bytes(file, row, bytes);
+	}
+}
+
+
+/*
+	Writes the RAW_HEADER_SIZE bytes before the rows of a raw or mask file.
+*/
+void write_header(FILE *file, const char *magic, struct image_buffer *image, const unsigned stride) {
+	png_byte bytes[RAW_HEADER_SIZE] = {0};
+	struct raw_header header;
+	memcpy(header.magic, magic, sizeof(header.magic));
+	header.width = image->width;
+	header.height = image->height;
+	header.stride = stride;
+	memcpy(bytes, &header, sizeof(header));
+	write_bytes(file, bytes, sizeof(bytes));
+}
+
+
+/*
+	fwrite that fails through arena_failure when the file cannot take all of the bytes.
+	Most failures only show up once the buffer of file is flushed, which encode_image
+	checks.
+*/
+void write_bytes(FILE *file, const void *data, const size_t size) {
+	if (fwrite(data, 1, size, file) != size) {
+		arena_failure("Failed to write the output file.");
+	}
+}
@@ -0,0 +1,88 @@
+/*
+	Bytes before the first row of the raw and mask formats. Rows of a raw file written
+	here start IMAGE_ALIGNMENT bytes apart, so once the file is mapped every row is as
+	aligned as a row of allocate_image.
+*/
+#define RAW_HEADER_SIZE IMAGE_ALIGNMENT
+
+/*
+	Start of the raw and mask formats, followed by zeros up to RAW_HEADER_SIZE. magic
+	tells the two apart, the numbers are in the byte order of the machine and stride is
+	the number of bytes from the start of one row to the start of the next.
+*/
+struct raw_header {
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+};
+
+/*
+	Where the pixels of a file start and how they are laid out, as read from its
+	header.
+*/
+struct image_header {
+	unsigned width;
+	unsigned height;
+	unsigned stride;
+	size_t offset;
+};
+
+/*
+	How to read and write one format. parse reads the header at the start of a file,
+	read turns the rows after it into an image and write writes an image with its
+	header, taking any buffer it needs from the arena it is given. The PNG entry has
+	none of them since PNG goes through PNG_LIB in ced.c, which can also decode row by
+	row for the streaming version and the region of interest.
+*/
+struct image_backend {
+	const char *name;
+	const char *extension;
+	bool (*parse)(png_bytep, const size_t, struct image_header *);
+	void (*read)(png_bytep, struct image_header *, struct image_buffer *, struct arena *);
+	void (*write)(FILE *, struct image_buffer *, struct arena *);
+};
+
+extern const struct image_backend image_backends[IMAGE_FORMATS];
+
+enum image_format image_format(const char *);
+
+void read_image(FILE *, struct mapped_file *, const enum image_format, struct image_buffer *, struct arena *);
+
+void write_image(FILE *, const enum image_format, struct image_buffer *, struct arena *);
+
+size_t probe_image(png_bytep, const size_t, const enum image_format);
+
+png_bytep read_stream(FILE *, size_t *, struct arena *);
+
+bool parse_raw(png_bytep, const size_t, struct image_header *);
+
+bool parse_mask(png_bytep, const size_t, struct image_header *);
+
+bool parse_raw_header(png_bytep, const size_t, const char *, const unsigned, struct image_header *);
+
+bool parse_pgm(png_bytep, const size_t, struct image_header *);
+
+bool parse_pbm(png_bytep, const size_t, struct image_header *);
+
+bool parse_pnm(png_bytep, const size_t, const char, const bool, struct image_header *);
+
+bool pnm_number(png_bytep, const size_t, size_t *, unsigned *);
+
+void read_view(png_bytep, struct image_header *, struct image_buffer *, struct arena *);
+
+void read_pbm(png_bytep, struct image_header *, struct image_buffer *, struct arena *);
+
+void read_mask(png_bytep, struct image_header *, struct image_buffer *, struct arena *);
+
+void write_raw(FILE *, struct image_buffer *, struct arena *);
+
+void write_mask(FILE *, struct image_buffer *, struct arena *);
+
+void write_pgm(FILE *, struct image_buffer *, struct arena *);
+
+void write_pbm(FILE *, struct image_buffer *, struct arena *);
+
+void write_header(FILE *, const char *, struct image_buffer *, const unsigned);
+
+void write_bytes(FILE *, const void *, const size_t);
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <omp.h>
+#include "profile.h"
+
+/*
+	Wall clock profiler for the stages of the algorithm. It is off unless profile_init
+	is given an output path, and while it is off profile_start and profile_record return
+	straight away without reading the clock. The time comes from omp_get_wtime, which
+	is monotonic and counts wall time rather than the CPU time of every thread like
+	clock does.
+
+	Samples from every thread go into one table per stage under a lock, which is fine
+	since a stage takes far longer than the lock. Each thread that records a sample
+	gets its own small index, and the per thread totals are the stages each thread
+	started and waited for: the threads of the batch pipeline, and the threads that run
+	small batch images one per thread. A stage that splits its work over a parallel
+	region is recorded once, as wall time, for the thread that entered the region, so
+	the per thread totals do not show how that work was spread over the OpenMP threads.
+
+	profile_finish writes the batch totals as JSON: for every stage the number of runs
+	and the total, min, median, p99 and max of their times, and for every thread the
+	total time it spent in each stage.
+*/
+
+bool profile_enabled = false;
+
+static const char *stage_names[PROFILE_STAGES] = {"decode", "gaussian", "gradients", "suppression", "tiled", "streaming", "pyramid", "hysteresis", "encode", "image"};
+
+static struct profile_samples stages[PROFILE_STAGES];
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *profile_path;
+static double profile_begin;
+static int profile_threads = 0;
+static __thread int thread_index = -1;
+
+
+/*
+	Turns the profiler on and writes its results to path when profile_finish is
+	called, or to stdout if path is "-". A NULL path leaves it off.
+*/
+void profile_init(const char *path) {
+	if (path == NULL) {
+		return;
+	}
+	profile_path = path;
+	profile_enabled = true;
+	profile_begin = omp_get_wtime();
+}
+
+
+/*
+	Returns the time a stage starts at, for profile_record.
+*/
+double profile_start(void) {
+	return profile_enabled ? omp_get_wtime() : 0;
+}
+
+
+/*
+	Records a run of stage that started at start and ends now.
+*/
+void profile_record(const enum profile_stage stage, const double start) {
+	if (!profile_enabled) {
+		return;
+	}
+	const double seconds = omp_get_wtime() - start;
+	const int thread = profile_thread();
+	pthread_mutex_lock(&profile_lock);
+	struct profile_samples *samples = &stages[stage];
+	if (samples->count == samples->capacity) {
+		samples->capacity = samples->capacity ? 2 * samples->capacity : 64;
+		samples->samples = realloc(samples->samples, samples->capacity * sizeof(struct profile_sample));
+		if (samples->samples == NULL) {
+			fprintf(stderr, "Failed to allocate space for the profile.\n");
+			exit(1);
+		}
+	}
+	samples->samples[samples->count].seconds = seconds;
+	samples->samples[samples->count].thread = thread;
+	samples->count++;
+	pthread_mutex_unlock(&profile_lock);
+}
+
+
+/*
+	Writes the results of the batch and frees the samples.
+*/
+void profile_finish(void) {
+	if (!profile_enabled) {
+		return;
+	}
+	const double wall = omp_get_wtime() - profile_begin;
+	FILE *file = strcmp(profile_path, "-") ? fopen(profile_path, "w") : stdout;
+	if (file == NULL) {
+		fprintf(stderr, "Unable to create profile file.\n");
+		exit(1);
+	}
+	fprintf(file, "{\n\t\"wall_seconds\": %.9f,\n\t\"threads\": %d,\n\t\"stages\": {", wall, profile_threads);
+	bool first = true;
+	for (int s = 0; s < PROFILE_STAGES; s++) {
+		const unsigned count = stages[s].count;
+		if (count == 0) {
+			continue;
+		}
+		double *seconds = malloc(count * sizeof(double));
+		if (seconds == NULL) {
+			fprintf(stderr, "Failed to allocate space for the profile.\n");
+			exit(1);
+		}
+		double total = 0;
+		for (unsigned i = 0; i < count; i++) {
+			seconds[i] = stages[s].samples[i].seconds;
+			total += seconds[i];
+		}
+		qsort(seconds, count, sizeof(double), compare_seconds);
+		fprintf(file, "%s\n\t\t\"%s\": {\"count\": %u, \"total\": %.9f, \"min\": %.9f, \"median\": %.9f, \"p99\": %.9f, \"max\": %.9f}", first ? "" : ",", stage_names[s], count, total, seconds[0], seconds[(count - 1) / 2], seconds[(99 * count + 99) / 100 - 1], seconds[count - 1]);
+		free(seconds);
+		first = false;
+	}
+	fprintf(file, "\n\t},\n\t\"per_thread\": [");
+	for (int t = 0; t < profile_threads; t++) {
+		fprintf(file, "%s\n\t\t{\"thread\": %d", t ? "," : "", t);
+		for (int s = 0; s < PROFILE_STAGES; s++) {
+			double total = 0;
+			unsigned count = 0;
+			for (unsigned i = 0; i < stages[s].count; i++) {
+				if (stages[s].samples[i].thread == t) {
+					total += stages[s].samples[i].seconds;
+					count++;
+				}
+			}
+			if (count > 0) {
+				fprintf(file, ", \"%s\": %.9f", stage_names[s], total);
+			}
+		}
+		fprintf(file, "}");
+	}
+	fprintf(file, "\n\t]\n}\n");
+	if (file != stdout) {
+		fclose(file);
+	}
+	for (int s = 0; s < PROFILE_STAGES; s++) {
+		free(stages[s].samples);
+		stages[s].samples = NULL;
+		stages[s].count = stages[s].capacity = 0;
+	}
+}
+
+
+/*
+	Returns the index of the calling thread, handing out the next one the first time a
+	thread asks.
+*/
+int profile_thread(void) {
+	if (thread_index < 0) {
+		thread_index = __atomic_fetch_add(&profile_threads, 1, __ATOMIC_RELAXED);
+	}
+	return thread_index;
+}
+
+
+/*
+	Orders times from shortest to longest for qsort.
+*/
+int compare_seconds(const void *a, const void *b) {
+	const double seconds_a = *(const double *) a;
+	const double seconds_b = *(const double *) b;
+	return (seconds_a > seconds_b) - (seconds_a < seconds_b);
+}
@@ -0,0 +1,50 @@
+/*
+	Stages the profiler keeps apart. The tiled and streaming versions run the first
+	three steps together so they get stages of their own, as do the gradients and NMS
+	of all the levels of the multi-scale mode, and STAGE_IMAGE is the time
+	from the start of the decode of an image to the end of its encode.
+*/
+enum profile_stage {
+	STAGE_DECODE,
+	STAGE_GAUSSIAN,
+	STAGE_GRADIENTS,
+	STAGE_SUPPRESSION,
+	STAGE_TILED,
+	STAGE_STREAMING,
+	STAGE_PYRAMID,
+	STAGE_HYSTERESIS,
+	STAGE_ENCODE,
+	STAGE_IMAGE,
+	PROFILE_STAGES
+};
+
+/*
+	One timed run of a stage and the profiler thread that ran it.
+*/
+struct profile_sample {
+	double seconds;
+	int thread;
+};
+
+/*
+	Every sample of one stage.
+*/
+struct profile_samples {
+	struct profile_sample *samples;
+	unsigned count;
+	unsigned capacity;
+};
+
+extern bool profile_enabled;
+
+void profile_init(const char *);
+
+double profile_start(void);
+
+void profile_record(const enum profile_stage, const double);
+
+void profile_finish(void);
+
+int profile_thread(void);
+
+int compare_seconds(const void *, const void *);
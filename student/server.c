@@ -0,0 +1,232 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <omp.h>
+#include <png.h>
+#include "arena.h"
+#include "ced.h"
+#include "canny.h"
+#include "student.h"
+#include "server.h"
+
+/*
+	Server mode runs the images of many requests in one process, so the OpenMP threads,
+	the kernels gaussian_kernel has built, the scratch arenas of the threads and the
+	job of the context stay warm between images instead of being set up again by every
+	run of the program, which is most of the time a small image takes.
+
+	Every job is a line of the form
+
+		src dst [sigma [high low]]
+
+	with the fields separated by whitespace (so paths cannot contain any) and sigma and
+	the thresholds defaulting to those of a batch. The line quit stops the server. Every
+	job line gets one line back, in order, once its output file is complete:
+
+		n ok decode=<seconds> compute=<seconds> encode=<seconds> total=<seconds>
+		n error <reason>
+
+	where n counts the job lines of the stream from 1. Jobs run one at a time with every
+	thread, like the large images of a batch. Lines the server cannot run are answered
+	with an error, and so are images that fail partway, such as a truncated file or
+	running out of memory, with the reason decode failed, compute failed or encode
+	failed and no output file left behind. The parallel steps take their memory on the
+	calling thread before they start, so none of these failures happen where they
+	could not be returned from.
+*/
+
+
+/*
+	Runs the jobs read from stdin with the records going to stdout when path is "-",
+	and otherwise the jobs of every connection to a Unix domain socket created at path,
+	one connection after another, until a quit line or the end of stdin.
+*/
+void serve(const char *path) {
+	struct canny_context context;
+	context_init(&context, 1);
+
+	//A client that leaves early must not take the server with it
+	signal(SIGPIPE, SIG_IGN);
+
+	if (strcmp(path, "-") == 0) {
+		serve_stream(stdin, stdout, &context);
+	} else {
+		const int listener = listen_socket(path);
+		bool quit = false;
+		while (!quit) {
+			const int connection = accept(listener, NULL, NULL);
+			if (connection < 0 && errno == EINTR) {
+				continue;
+			}
+			if (connection < 0) {
+				fprintf(stderr, "Unable to accept a connection.\n");
+				exit(1);
+			}
+			FILE *in = fdopen(connection, "r");
+			FILE *out = fdopen(dup(connection), "w");
+			if (in == NULL || out == NULL) {
+				fprintf(stderr, "Unable to open the connection.\n");
+				exit(1);
+			}
+			quit = serve_stream(in, out, &context);
+			fclose(in);
+			fclose(out);
+		}
+		close(listener);
+		unlink(path);
+	}
+	context_destroy(&context);
+}
+
+
+/*
+	Runs the jobs read from in and writes their records to out. Returns true if the
+	stream asked the server to quit.
+*/
+bool serve_stream(FILE *in, FILE *out, struct canny_context *context) {
+	char line[SERVER_LINE_MAX];
+	char src[SERVER_LINE_MAX];
+	char dst[SERVER_LINE_MAX];
+	unsigned long count = 0;
+	while (fgets(line, sizeof(line), in) != NULL) {
+		const size_t length = strlen(line);
+		if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+			//Skip the rest of a line that does not fit
+			int c;
+			while ((c = fgetc(in)) != EOF && c != '\n');
+			fprintf(out, "%lu error line too long\n", ++count);
+			fflush(out);
+			continue;
+		}
+		if (sscanf(line, "%s", src) != 1) {
+			continue;
+		}
+		if (strcmp(src, "quit") == 0) {
+			return true;
+		}
+		count++;
+		struct canny_params params = options.params;
+		const char *error;
+		if (parse_job(line, src, dst, &params, &error)) {
+			run_job(out, count, src, dst, &params, context);
+		} else {
+			fprintf(out, "%lu error %s\n", count, error);
+		}
+		fflush(out);
+	}
+	return false;
+}
+
+
+/*
+	Reads the fields of the job line into src, dst and params, which already hold the
+	defaults. Returns false with the reason in error if the job cannot be run.
+*/
+bool parse_job(char *line, char *src, char *dst, struct canny_params *params, const char **error) {
+	int words = 0;
+	for (char *c = line; *c != '\0'; c++) {
+		words += !isspace((unsigned char) *c) && (c == line || isspace((unsigned char) c[-1]));
+	}
+	const int fields = sscanf(line, "%s %s %f %u %u", src, dst, &params->sigma, &params->high, &params->low);
+	if (fields != words || (fields != 2 && fields != 3 && fields != 5)) {
+		*error = "expected src dst [sigma [high low]]";
+		return false;
+	}
+	if (!(params->sigma >= CANNY_MIN_SIGMA && params->sigma <= CANNY_MAX_SIGMA)) {
+		*error = "sigma out of range";
+		return false;
+	}
+	if (params->low > params->high || params->high > MAX_BRIGHTNESS) {
+		*error = "thresholds must be low <= high <= 255";
+		return false;
+	}
+	if (probe_pixels(src) == 0) {
+		*error = "unable to read the source image";
+		return false;
+	}
+	FILE *dst_file = fopen(dst, "ab");
+	if (dst_file == NULL) {
+		*error = "unable to create the destination file";
+		return false;
+	}
+	fclose(dst_file);
+	return true;
+}
+
+
+/*
+	Runs one job on the job of context with every thread and writes its record to out.
+	Failures of the stages on this thread come back here through arena_recover instead
+	of ending the server, and the job is abandoned with the stage that failed as the
+	reason.
+*/
+void run_job(FILE *out, const unsigned long count, char *src, char *dst, struct canny_params *params, struct canny_context *context) {
+	struct canny_job *job = &context->jobs[0];
+	struct arena *scratch = thread_arena();
+	const size_t mark = arena_mark(scratch);
+	const char *volatile stage = "decode failed";
+	jmp_buf jump;
+	if (setjmp(jump)) {
+		arena_recover(NULL);
+		arena_release(scratch, mark);
+		abandon_image(job);
+		remove(dst);
+		fprintf(out, "%lu error %s\n", count, stage);
+		return;
+	}
+	arena_recover(&jump);
+
+	job->src_file = NULL;
+	job->dst_file = NULL;
+	const double start = omp_get_wtime();
+	decode_image(job, src, dst, &options.roi, params);
+	const double decoded = omp_get_wtime();
+	stage = "compute failed";
+	compute_image(job);
+	const double computed = omp_get_wtime();
+	stage = "encode failed";
+	encode_image(job);
+	const double encoded = omp_get_wtime();
+	arena_recover(NULL);
+	fprintf(out, "%lu ok decode=%.6f compute=%.6f encode=%.6f total=%.6f\n", count, decoded - start, computed - decoded, encoded - computed, encoded - start);
+}
+
+
+/*
+	Creates the Unix domain socket at path and returns it listening. A socket left at
+	path by an earlier server is replaced, anything else there is an error.
+*/
+int listen_socket(const char *path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "The socket path is too long.\n");
+		exit(1);
+	}
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	struct stat info;
+	if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+		unlink(path);
+	}
+	const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listener, SERVER_BACKLOG) != 0) {
+		fprintf(stderr, "Unable to listen on the socket.\n");
+		exit(1);
+	}
+	return listener;
+}
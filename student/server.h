@@ -0,0 +1,19 @@
+/*
+	Longest job line the server reads, the newline included.
+*/
+#define SERVER_LINE_MAX 4096
+
+/*
+	Connections the socket of the server lets wait while it runs the jobs of another.
+*/
+#define SERVER_BACKLOG 8
+
+void serve(const char *);
+
+bool serve_stream(FILE *, FILE *, struct canny_context *);
+
+bool parse_job(char *, char *, char *, struct canny_params *, const char **);
+
+void run_job(FILE *, const unsigned long, char *, char *, struct canny_params *, struct canny_context *);
+
+int listen_socket(const char *);
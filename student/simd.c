@@ -0,0 +1,491 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <png.h>
+#include <x86intrin.h>
+#include "arena.h"
+#include "ced.h"
+#include "canny.h"
+#include "student.h"
+#include "simd.h"
+
+/*
+	Vector versions of the row kernels in student.c. The functions are compiled for
+	their instruction set with the target attribute rather than with -m flags so the
+	rest of the program still runs on machines without them, and simd_init decides
+	at startup (using CPUID) which ones are safe to call.
+
+	The float kernels accumulate the taps in the same order as the scalar code and
+	never fuse the multiply and add, and the fixed point kernels are exact, so every
+	path is bit for bit identical.
+
+	The AVX2 kernels clear the upper register halves themselves before returning since
+	the compiler only does it for optimized builds, and leaving them dirty makes every
+	later SSE instruction (including the ones inside libm) pay a transition penalty.
+*/
+
+static const struct simd_kernels scalar_kernels = {"scalar", gaussian_row_h, gaussian_row_v, gaussian_row_h_fixed, gaussian_row_v_fixed, gradient_row, suppression_row, range_row, normalize_row};
+
+struct simd_kernels simd = {"scalar", gaussian_row_h, gaussian_row_v, gaussian_row_h_fixed, gaussian_row_v_fixed, gradient_row, suppression_row, range_row, normalize_row};
+
+
+/*
+	SSE4.1: 4 floats, 4 32-bit sums or 8 16-bit pixels per instruction.
+*/
+__attribute__((target("sse4.1")))
+static void gaussian_row_h_sse(png_bytep input, float *output, float *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	unsigned m = half;
+	for (; m + 4 <= width - half; m += 4) {
+		__m128 pixel = _mm_setzero_ps();
+		for (int i = 0; i < z; i++) {
+			int bytes;
+			memcpy(&bytes, input + m + half - i, sizeof(bytes));
+			__m128 values = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+			pixel = _mm_add_ps(pixel, _mm_mul_ps(values, _mm_set1_ps(kernel[i])));
+		}
+		_mm_storeu_ps(output + m, pixel);
+	}
+	for (; m < width - half; m++) {
+		float pixel = 0.0;
+		for (int i = 0; i < z; i++) {
+			pixel += input[m + half - i] * kernel[i];
+		}
+		output[m] = pixel;
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void gaussian_row_v_sse(float **rows, float *output, float *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	unsigned m = half;
+	for (; m + 4 <= width - half; m += 4) {
+		__m128 pixel = _mm_setzero_ps();
+		for (int j = 0; j < z; j++) {
+			pixel = _mm_add_ps(pixel, _mm_mul_ps(_mm_loadu_ps(rows[j] + m), _mm_set1_ps(kernel[j])));
+		}
+		_mm_storeu_ps(output + m - half, pixel);
+	}
+	for (; m < width - half; m++) {
+		float pixel = 0.0;
+		for (int j = 0; j < z; j++) {
+			pixel += rows[j][m] * kernel[j];
+		}
+		output[m - half] = pixel;
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void gaussian_row_h_fixed_sse(png_bytep input, int16_t *output, int16_t *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	unsigned m = half;
+	for (; m + 8 <= width - half; m += 8) {
+		__m128i pixel = _mm_setzero_si128();
+		for (int i = 0; i < z; i++) {
+			__m128i values = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *) (input + m + half - i)));
+			pixel = _mm_add_epi16(pixel, _mm_mullo_epi16(values, _mm_set1_epi16(kernel[i])));
+		}
+		_mm_storeu_si128((__m128i *) (output + m), pixel);
+	}
+	for (; m < width - half; m++) {
+		int16_t pixel = 0;
+		for (int i = 0; i < z; i++) {
+			pixel += input[m + half - i] * kernel[i];
+		}
+		output[m] = pixel;
+	}
+}
+
+/*
+	The vertical fixed point passes interleave two rows so madd multiplies and adds two
+	taps at once into 32-bit sums. An odd last tap is paired with a zero weight.
+*/
+__attribute__((target("sse4.1")))
+static void gaussian_row_v_fixed_sse(int16_t **rows, float *output, int16_t *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	unsigned m = half;
+	for (; m + 8 <= width - half; m += 8) {
+		__m128i low = _mm_setzero_si128();
+		__m128i high = _mm_setzero_si128();
+		for (int j = 0; j < z; j += 2) {
+			__m128i first = _mm_loadu_si128((__m128i *) (rows[j] + m));
+			__m128i second = j + 1 < z ? _mm_loadu_si128((__m128i *) (rows[j + 1] + m)) : _mm_setzero_si128();
+			__m128i weights = _mm_set1_epi32((uint16_t) kernel[j] | (j + 1 < z ? (uint32_t) (uint16_t) kernel[j + 1] << 16 : 0));
+			low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(first, second), weights));
+			high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(first, second), weights));
+		}
+		_mm_storeu_ps(output + m - half, _mm_cvtepi32_ps(low));
+		_mm_storeu_ps(output + m - half + 4, _mm_cvtepi32_ps(high));
+	}
+	for (; m < width - half; m++) {
+		int32_t pixel = 0;
+		for (int j = 0; j < z; j++) {
+			pixel += rows[j][m] * kernel[j];
+		}
+		output[m - half] = pixel;
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void gradient_row_sse(png_bytep *rows, float *G, png_bytep dir, const unsigned width) {
+	const __m128i low_byte = _mm_set1_epi16(0xFF);
+	const __m128i zero = _mm_setzero_si128();
+	unsigned m = 1;
+	for (; m + 9 <= width; m += 8) {
+		__m128i sums[2];
+		for (int r = 0; r < 2; r++) {
+			png_bytep row = rows[2 * r] + m;
+			__m128i left = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *) (row - 1)));
+			__m128i center = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *) row));
+			__m128i right = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *) (row + 1)));
+			sums[r] = _mm_add_epi16(_mm_add_epi16(left, right), _mm_add_epi16(center, center));
+		}
+		__m128i gx16 = _mm_and_si128(_mm_sub_epi16(sums[0], sums[1]), low_byte);
+		__m128i sectors[2];
+		for (int h = 0; h < 2; h++) {
+			__m128i gx = _mm_cvtepi16_epi32(h == 0 ? gx16 : _mm_srli_si128(gx16, 8));
+			__m128i gy = gx;
+			__m128i magnitude = _mm_add_epi32(_mm_mullo_epi32(gx, gx), _mm_mullo_epi32(gy, gy));
+			_mm_storeu_ps(G + m + 4 * h, _mm_sqrt_ps(_mm_cvtepi32_ps(magnitude)));
+
+			//The integer sector tests of gradient_sector
+			__m128i ax = _mm_abs_epi32(gx);
+			__m128i ay = _mm_abs_epi32(gy);
+			__m128i twice = _mm_slli_epi32(_mm_mullo_epi32(ax, ax), 1);
+			__m128i sum = _mm_add_epi32(ax, ay);
+			__m128i difference = _mm_sub_epi32(ay, ax);
+			__m128i tilted = _mm_cmpgt_epi32(_mm_mullo_epi32(sum, sum), twice);
+			__m128i steep = _mm_and_si128(_mm_cmpgt_epi32(ay, ax), _mm_cmpgt_epi32(_mm_mullo_epi32(difference, difference), twice));
+			__m128i opposite = _mm_cmpgt_epi32(zero, _mm_xor_si128(gx, gy));
+			__m128i sector = _mm_blendv_epi8(_mm_set1_epi32(SECTOR_45), _mm_set1_epi32(SECTOR_135), opposite);
+			sector = _mm_blendv_epi8(sector, _mm_set1_epi32(SECTOR_90), steep);
+			sectors[h] = _mm_blendv_epi8(_mm_set1_epi32(SECTOR_0), sector, tilted);
+		}
+		__m128i packed = _mm_packs_epi32(sectors[0], sectors[1]);
+		_mm_storel_epi64((__m128i *) (dir + m), _mm_packus_epi16(packed, packed));
+	}
+	for (; m < width - 1; m++) {
+		int above = rows[0][m - 1] + 2 * rows[0][m] + rows[0][m + 1];
+		int below = rows[2][m - 1] + 2 * rows[2][m] + rows[2][m + 1];
+		int gx = (png_byte) (above - below);
+		int gy = gx;
+		G[m] = sqrtf(gx * gx + gy * gy);
+		dir[m] = gradient_sector(gx, gy);
+	}
+}
+
+
+/*
+	AVX2: 8 floats, 8 32-bit sums or 16 16-bit pixels per instruction.
+*/
+__attribute__((target("avx2")))
+static void gaussian_row_h_avx2(png_bytep input, float *output, float *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	unsigned m = half;
+	for (; m + 8 <= width - half; m += 8) {
+		__m256 pixel = _mm256_setzero_ps();
+		for (int i = 0; i < z; i++) {
+			__m256 values = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) (input + m + half - i))));
+			pixel = _mm256_add_ps(pixel, _mm256_mul_ps(values, _mm256_set1_ps(kernel[i])));
+		}
+		_mm256_storeu_ps(output + m, pixel);
+	}
+	_mm256_zeroupper();
+	for (; m < width - half; m++) {
+		float pixel = 0.0;
+		for (int i = 0; i < z; i++) {
+			pixel += input[m + half - i] * kernel[i];
+		}
+		output[m] = pixel;
+	}
+}
+
+__attribute__((target("avx2")))
+static void gaussian_row_v_avx2(float **rows, float *output, float *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	unsigned m = half;
+	for (; m + 8 <= width - half; m += 8) {
+		__m256 pixel = _mm256_setzero_ps();
+		for (int j = 0; j < z; j++) {
+			pixel = _mm256_add_ps(pixel, _mm256_mul_ps(_mm256_loadu_ps(rows[j] + m), _mm256_set1_ps(kernel[j])));
+		}
+		_mm256_storeu_ps(output + m - half, pixel);
+	}
+	_mm256_zeroupper();
+	for (; m < width - half; m++) {
+		float pixel = 0.0;
+		for (int j = 0; j < z; j++) {
+			pixel += rows[j][m] * kernel[j];
+		}
+		output[m - half] = pixel;
+	}
+}
+
+__attribute__((target("avx2")))
+static void gaussian_row_h_fixed_avx2(png_bytep input, int16_t *output, int16_t *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	unsigned m = half;
+	for (; m + 16 <= width - half; m += 16) {
+		__m256i pixel = _mm256_setzero_si256();
+		for (int i = 0; i < z; i++) {
+			__m256i values = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (input + m + half - i)));
+			pixel = _mm256_add_epi16(pixel, _mm256_mullo_epi16(values, _mm256_set1_epi16(kernel[i])));
+		}
+		_mm256_storeu_si256((__m256i *) (output + m), pixel);
+	}
+	_mm256_zeroupper();
+	for (; m < width - half; m++) {
+		int16_t pixel = 0;
+		for (int i = 0; i < z; i++) {
+			pixel += input[m + half - i] * kernel[i];
+		}
+		output[m] = pixel;
+	}
+}
+
+__attribute__((target("avx2")))
+static void gaussian_row_v_fixed_avx2(int16_t **rows, float *output, int16_t *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	unsigned m = half;
+	for (; m + 16 <= width - half; m += 16) {
+		__m256i low = _mm256_setzero_si256();
+		__m256i high = _mm256_setzero_si256();
+		for (int j = 0; j < z; j += 2) {
+			__m256i first = _mm256_loadu_si256((__m256i *) (rows[j] + m));
+			__m256i second = j + 1 < z ? _mm256_loadu_si256((__m256i *) (rows[j + 1] + m)) : _mm256_setzero_si256();
+			__m256i weights = _mm256_set1_epi32((uint16_t) kernel[j] | (j + 1 < z ? (uint32_t) (uint16_t) kernel[j + 1] << 16 : 0));
+			low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(first, second), weights));
+			high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(first, second), weights));
+		}
+		//unpack works within 128 bit lanes so low holds pixels 0-3 and 8-11, high 4-7 and 12-15
+		_mm256_storeu_ps(output + m - half, _mm256_cvtepi32_ps(_mm256_permute2x128_si256(low, high, 0x20)));
+		_mm256_storeu_ps(output + m - half + 8, _mm256_cvtepi32_ps(_mm256_permute2x128_si256(low, high, 0x31)));
+	}
+	_mm256_zeroupper();
+	for (; m < width - half; m++) {
+		int32_t pixel = 0;
+		for (int j = 0; j < z; j++) {
+			pixel += rows[j][m] * kernel[j];
+		}
+		output[m - half] = pixel;
+	}
+}
+
+__attribute__((target("avx2")))
+static void gradient_row_avx2(png_bytep *rows, float *G, png_bytep dir, const unsigned width) {
+	const __m256i low_byte = _mm256_set1_epi16(0xFF);
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned m = 1;
+	for (; m + 17 <= width; m += 16) {
+		__m256i sums[2];
+		for (int r = 0; r < 2; r++) {
+			png_bytep row = rows[2 * r] + m;
+			__m256i left = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (row - 1)));
+			__m256i center = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) row));
+			__m256i right = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (row + 1)));
+			sums[r] = _mm256_add_epi16(_mm256_add_epi16(left, right), _mm256_add_epi16(center, center));
+		}
+		__m256i gx16 = _mm256_and_si256(_mm256_sub_epi16(sums[0], sums[1]), low_byte);
+		__m256i sectors[2];
+		for (int h = 0; h < 2; h++) {
+			__m256i gx = _mm256_cvtepi16_epi32(h == 0 ? _mm256_castsi256_si128(gx16) : _mm256_extracti128_si256(gx16, 1));
+			__m256i gy = gx;
+			__m256i magnitude = _mm256_add_epi32(_mm256_mullo_epi32(gx, gx), _mm256_mullo_epi32(gy, gy));
+			_mm256_storeu_ps(G + m + 8 * h, _mm256_sqrt_ps(_mm256_cvtepi32_ps(magnitude)));
+
+			__m256i ax = _mm256_abs_epi32(gx);
+			__m256i ay = _mm256_abs_epi32(gy);
+			__m256i twice = _mm256_slli_epi32(_mm256_mullo_epi32(ax, ax), 1);
+			__m256i sum = _mm256_add_epi32(ax, ay);
+			__m256i difference = _mm256_sub_epi32(ay, ax);
+			__m256i tilted = _mm256_cmpgt_epi32(_mm256_mullo_epi32(sum, sum), twice);
+			__m256i steep = _mm256_and_si256(_mm256_cmpgt_epi32(ay, ax), _mm256_cmpgt_epi32(_mm256_mullo_epi32(difference, difference), twice));
+			__m256i opposite = _mm256_cmpgt_epi32(zero, _mm256_xor_si256(gx, gy));
+			__m256i sector = _mm256_blendv_epi8(_mm256_set1_epi32(SECTOR_45), _mm256_set1_epi32(SECTOR_135), opposite);
+			sector = _mm256_blendv_epi8(sector, _mm256_set1_epi32(SECTOR_90), steep);
+			sectors[h] = _mm256_blendv_epi8(_mm256_set1_epi32(SECTOR_0), sector, tilted);
+		}
+		//packs works within 128 bit lanes so the result has to be put back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(sectors[0], sectors[1]), 0xD8);
+		_mm_storeu_si128((__m128i *) (dir + m), _mm_packus_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1)));
+	}
+	_mm256_zeroupper();
+	for (; m < width - 1; m++) {
+		int above = rows[0][m - 1] + 2 * rows[0][m] + rows[0][m + 1];
+		int below = rows[2][m - 1] + 2 * rows[2][m] + rows[2][m + 1];
+		int gx = (png_byte) (above - below);
+		int gy = gx;
+		G[m] = sqrtf(gx * gx + gy * gy);
+		dir[m] = gradient_sector(gx, gy);
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void suppression_row_sse(float **G, png_bytep dir, png_bytep nms, const unsigned width) {
+	const __m128i low_byte = _mm_set1_epi32(0xFF);
+	unsigned m = 1;
+	for (; m + 9 <= width; m += 8) {
+		__m128i values[2];
+		for (int h = 0; h < 2; h++) {
+			const unsigned k = m + 4 * h;
+			__m128i sector = _mm_cvtepu8_epi32(_mm_loadu_si32(dir + k));
+			__m128 diagonal = _mm_castsi128_ps(_mm_cmpeq_epi32(sector, _mm_set1_epi32(SECTOR_45)));
+			__m128 vertical = _mm_castsi128_ps(_mm_cmpeq_epi32(sector, _mm_set1_epi32(SECTOR_90)));
+			__m128 antidiagonal = _mm_castsi128_ps(_mm_cmpeq_epi32(sector, _mm_set1_epi32(SECTOR_135)));
+			__m128 first = _mm_loadu_ps(G[1] + k - 1);
+			first = _mm_blendv_ps(first, _mm_loadu_ps(G[0] + k + 1), diagonal);
+			first = _mm_blendv_ps(first, _mm_loadu_ps(G[0] + k), vertical);
+			first = _mm_blendv_ps(first, _mm_loadu_ps(G[0] + k - 1), antidiagonal);
+			__m128 second = _mm_loadu_ps(G[1] + k + 1);
+			second = _mm_blendv_ps(second, _mm_loadu_ps(G[2] + k - 1), diagonal);
+			second = _mm_blendv_ps(second, _mm_loadu_ps(G[2] + k), vertical);
+			second = _mm_blendv_ps(second, _mm_loadu_ps(G[2] + k + 1), antidiagonal);
+			__m128 c = _mm_loadu_ps(G[1] + k);
+			__m128i kept = _mm_castps_si128(_mm_and_ps(_mm_cmpgt_ps(c, first), _mm_cmpgt_ps(c, second)));
+			values[h] = _mm_and_si128(_mm_and_si128(_mm_cvttps_epi32(c), low_byte), kept);
+		}
+		__m128i packed = _mm_packus_epi32(values[0], values[1]);
+		_mm_storel_epi64((__m128i *) (nms + m), _mm_packus_epi16(packed, packed));
+	}
+	for (; m < width - 1; m++) {
+		nms[m] = suppress_pixel(G, dir[m], m);
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void range_row_sse(float *input, const unsigned count, float *min, float *max) {
+	__m128 low = _mm_set1_ps(*min);
+	__m128 high = _mm_set1_ps(*max);
+	unsigned m = 0;
+	for (; m + 4 <= count; m += 4) {
+		__m128 values = _mm_loadu_ps(input + m);
+		low = _mm_min_ps(low, values);
+		high = _mm_max_ps(high, values);
+	}
+	float lows[4], highs[4];
+	_mm_storeu_ps(lows, low);
+	_mm_storeu_ps(highs, high);
+	for (int i = 0; i < 4; i++) {
+		*min = lows[i] < *min ? lows[i] : *min;
+		*max = highs[i] > *max ? highs[i] : *max;
+	}
+	range_row(input + m, count - m, min, max);
+}
+
+__attribute__((target("sse4.1")))
+static void normalize_row_sse(float *input, png_bytep output, const unsigned count, const float min, const float max) {
+	const __m128 low = _mm_set1_ps(min);
+	const __m128 range = _mm_set1_ps(max - min);
+	const __m128 brightness = _mm_set1_ps((png_byte) MAX_BRIGHTNESS);
+	unsigned m = 0;
+	for (; m + 8 <= count; m += 8) {
+		__m128i values[2];
+		for (int h = 0; h < 2; h++) {
+			__m128 scaled = _mm_div_ps(_mm_mul_ps(brightness, _mm_sub_ps(_mm_loadu_ps(input + m + 4 * h), low)), range);
+			values[h] = _mm_cvttps_epi32(scaled);
+		}
+		__m128i packed = _mm_packus_epi32(values[0], values[1]);
+		_mm_storel_epi64((__m128i *) (output + m), _mm_packus_epi16(packed, packed));
+	}
+	normalize_row(input + m, output + m, count - m, min, max);
+}
+
+static const struct simd_kernels sse_kernels = {"sse4.1", gaussian_row_h_sse, gaussian_row_v_sse, gaussian_row_h_fixed_sse, gaussian_row_v_fixed_sse, gradient_row_sse, suppression_row_sse, range_row_sse, normalize_row_sse};
+
+__attribute__((target("avx2")))
+static void suppression_row_avx2(float **G, png_bytep dir, png_bytep nms, const unsigned width) {
+	const __m256i low_byte = _mm256_set1_epi32(0xFF);
+	unsigned m = 1;
+	for (; m + 17 <= width; m += 16) {
+		__m256i values[2];
+		for (int h = 0; h < 2; h++) {
+			const unsigned k = m + 8 * h;
+			__m256i sector = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) (dir + k)));
+			__m256 diagonal = _mm256_castsi256_ps(_mm256_cmpeq_epi32(sector, _mm256_set1_epi32(SECTOR_45)));
+			__m256 vertical = _mm256_castsi256_ps(_mm256_cmpeq_epi32(sector, _mm256_set1_epi32(SECTOR_90)));
+			__m256 antidiagonal = _mm256_castsi256_ps(_mm256_cmpeq_epi32(sector, _mm256_set1_epi32(SECTOR_135)));
+			__m256 first = _mm256_loadu_ps(G[1] + k - 1);
+			first = _mm256_blendv_ps(first, _mm256_loadu_ps(G[0] + k + 1), diagonal);
+			first = _mm256_blendv_ps(first, _mm256_loadu_ps(G[0] + k), vertical);
+			first = _mm256_blendv_ps(first, _mm256_loadu_ps(G[0] + k - 1), antidiagonal);
+			__m256 second = _mm256_loadu_ps(G[1] + k + 1);
+			second = _mm256_blendv_ps(second, _mm256_loadu_ps(G[2] + k - 1), diagonal);
+			second = _mm256_blendv_ps(second, _mm256_loadu_ps(G[2] + k), vertical);
+			second = _mm256_blendv_ps(second, _mm256_loadu_ps(G[2] + k + 1), antidiagonal);
+			__m256 c = _mm256_loadu_ps(G[1] + k);
+			__m256i kept = _mm256_castps_si256(_mm256_and_ps(_mm256_cmp_ps(c, first, _CMP_GT_OQ), _mm256_cmp_ps(c, second, _CMP_GT_OQ)));
+			values[h] = _mm256_and_si256(_mm256_and_si256(_mm256_cvttps_epi32(c), low_byte), kept);
+		}
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(values[0], values[1]), 0xD8);
+		_mm_storeu_si128((__m128i *) (nms + m), _mm_packus_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1)));
+	}
+	_mm256_zeroupper();
+	for (; m < width - 1; m++) {
+		nms[m] = suppress_pixel(G, dir[m], m);
+	}
+}
+
+__attribute__((target("avx2")))
+static void range_row_avx2(float *input, const unsigned count, float *min, float *max) {
+	__m256 low = _mm256_set1_ps(*min);
+	__m256 high = _mm256_set1_ps(*max);
+	unsigned m = 0;
+	for (; m + 8 <= count; m += 8) {
+		__m256 values = _mm256_loadu_ps(input + m);
+		low = _mm256_min_ps(low, values);
+		high = _mm256_max_ps(high, values);
+	}
+	float lows[8], highs[8];
+	_mm256_storeu_ps(lows, low);
+	_mm256_storeu_ps(highs, high);
+	_mm256_zeroupper();
+	for (int i = 0; i < 8; i++) {
+		*min = lows[i] < *min ? lows[i] : *min;
+		*max = highs[i] > *max ? highs[i] : *max;
+	}
+	range_row(input + m, count - m, min, max);
+}
+
+__attribute__((target("avx2")))
+static void normalize_row_avx2(float *input, png_bytep output, const unsigned count, const float min, const float max) {
+	const __m256 low = _mm256_set1_ps(min);
+	const __m256 range = _mm256_set1_ps(max - min);
+	const __m256 brightness = _mm256_set1_ps((png_byte) MAX_BRIGHTNESS);
+	unsigned m = 0;
+	for (; m + 16 <= count; m += 16) {
+		__m256i values[2];
+		for (int h = 0; h < 2; h++) {
+			__m256 scaled = _mm256_div_ps(_mm256_mul_ps(brightness, _mm256_sub_ps(_mm256_loadu_ps(input + m + 8 * h), low)), range);
+			values[h] = _mm256_cvttps_epi32(scaled);
+		}
+		//packus works within 128 bit lanes so the result has to be put back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(values[0], values[1]), 0xD8);
+		_mm_storeu_si128((__m128i *) (output + m), _mm_packus_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1)));
+	}
+	_mm256_zeroupper();
+	normalize_row(input + m, output + m, count - m, min, max);
+}
+
+static const struct simd_kernels avx2_kernels = {"avx2", gaussian_row_h_avx2, gaussian_row_v_avx2, gaussian_row_h_fixed_avx2, gaussian_row_v_fixed_avx2, gradient_row_avx2, suppression_row_avx2, range_row_avx2, normalize_row_avx2};
+
+
+/*
+	Selects the kernels for the running CPU. Setting CED_SIMD to scalar, sse4.1 or
+	avx2 caps the selection, which is useful for comparing the paths against each other.
+*/
+void simd_init(void) {
+	const char *cap = getenv("CED_SIMD");
+	bool allow_avx2 = cap == NULL || strcmp(cap, "avx2") == 0;
+	bool allow_sse = allow_avx2 || strcmp(cap, "sse4.1") == 0;
+	__builtin_cpu_init();
+	if (allow_avx2 && __builtin_cpu_supports("avx2")) {
+		simd = avx2_kernels;
+	} else if (allow_sse && __builtin_cpu_supports("sse4.1")) {
+		simd = sse_kernels;
+	} else {
+		simd = scalar_kernels;
+	}
+}
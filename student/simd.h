@@ -0,0 +1,20 @@
+/*
+	Table of the row kernels that have vector implementations. simd_init picks the
+	widest instruction set the running CPU supports so one binary can be used on
+	every machine. Every entry produces exactly the same output as the scalar code.
+*/
+struct simd_kernels {
+	const char *name;
+	void (*gaussian_row_h)(png_bytep, float *, float *, const unsigned, const int);
+	void (*gaussian_row_v)(float **, float *, float *, const unsigned, const int);
+	void (*gaussian_row_h_fixed)(png_bytep, int16_t *, int16_t *, const unsigned, const int);
+	void (*gaussian_row_v_fixed)(int16_t **, float *, int16_t *, const unsigned, const int);
+	void (*gradient_row)(png_bytep *, float *, png_bytep, const unsigned);
+	void (*suppression_row)(float **, png_bytep, png_bytep, const unsigned);
+	void (*range_row)(float *, const unsigned, float *, float *);
+	void (*normalize_row)(float *, png_bytep, const unsigned, const float, const float);
+};
+
+extern struct simd_kernels simd;
+
+void simd_init(void);
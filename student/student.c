@@ -1,14 +1,22 @@
+#define _POSIX_C_SOURCE 200112L
 #include <float.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
 #include <png.h>
-#include <time.h>
 #include <x86intrin.h>
 #include <omp.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include "arena.h"
 #include "ced.h"
+#include "canny.h"
 #include "student.h"
+#include "simd.h"
+#include "profile.h"
+#include "image_io.h"
 /*
     This file should contain all functions that are necessary to change to complete
     the project. Per the requirements given in the specification online you are
@@ -61,6 +69,30 @@
     as being incorrect.)
 */
 
+/*
+    Options that apply to every image of a run, set from the command line in ced.c.
+*/
+struct canny_options options = {false, 1, {0, 0, 0, 0, ROI_MARGIN}, ENCODE_DEFAULT, false, {.99, 105, 45}};
+
+/*
+    Kernels of the sigmas Canny is usually run with, as built by build_gaussian_kernel
+    and written out as exact hex floats so they are bit for bit what it would compute.
+    .99 is the sigma the program uses unless a job of the server asks for another.
+*/
+static const struct gaussian gaussian_table[] = {
+	{.sigma = 0x1.fae148p-1, .size = 5, .element = sizeof(float), .weights = {0x1.c85ab8p-1, 0x1.1cd8cp-4, 0x1.ed35f6p-7, 0x1.28203ap-7, 0x1.ed35f6p-7}, .fixed_weights = {114, 9, 2, 1, 2}},
+	{.sigma = 0x1p+0, .size = 7, .element = sizeof(float), .weights = {0x1.edec9p-1, 0x1.dd497p-6, 0x1.396cbcp-9, 0x1.17bcfp-11, 0x1.5356e4p-12, 0x1.17bcfp-11, 0x1.396cbcp-9}, .fixed_weights = {124, 4, 0, 0, 0, 0, 0}},
+	{.sigma = 0x1.666666p+0, .size = 7, .element = sizeof(float), .weights = {0x1.835aa6p-1, 0x1.03cd48p-3, 0x1.223d16p-5, 0x1.0e0876p-6, 0x1.a276a4p-7, 0x1.0e0876p-6, 0x1.223d16p-5}, .fixed_weights = {96, 16, 5, 2, 2, 2, 5}},
+	{.sigma = 0x1p+1, .size = 11, .element = sizeof(float), .weights = {0x1.488ccep-1, 0x1.4c4826p-3, 0x1.af8124p-5, 0x1.67c172p-6, 0x1.81206ap-7, 0x1.08b182p-7, 0x1.d32ea6p-8, 0x1.08b182p-7, 0x1.81206ap-7, 0x1.67c172p-6, 0x1.af8124p-5}, .fixed_weights = {80, 21, 7, 3, 2, 1, 1, 1, 2, 3, 7}},
+};
+
+/*
+    Kernels built at run time for the sigmas that are not in gaussian_table.
+*/
+static struct gaussian gaussian_cache[GAUSSIAN_CACHE_SIZE];
+static unsigned gaussian_cached = 0;
+static pthread_mutex_t gaussian_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
     This function interacts with ced.c to perform the canny_edge_detection algorithm
     on the src file.
@@ -81,7 +113,7 @@
 
     2. Calculate the intensity gradient using two known matrices and performing
     a convolution on them. This will be used to determine angles of pixels for
-    future steps.
+    future steps. The angle is already bucketed into a direction sector here.
 
     3. Perform non-maximal supression on the pixels. This means that for each pixel
     determine the angle of its gradient: either 0, 45, 90, or 135. This is initially
@@ -94,128 +126,263 @@
     neighbors an edge.
 
     Finally once these are complete the actual write will be performed.
+
+    The work is split into decode_image, compute_image and encode_image so that batch
+    mode can run the stages of different images at the same time. job comes from the
+    canny_context of the batch and keeps its memory from one image to the next.
+
+    When roi is not NULL and not empty only the edges inside that rectangle of the image
+    are found and written, see decode_region. params holds the sigma of step 1 and the
+    thresholds of step 4.
 */
-void canny_edge_detection(char* src, char* dst) {
-	clock_t start, end, time_one, time_two, time_three, time_four, time_five, time_six, time_seven, time_eight, time_nine;
+void canny_edge_detection(char* src, char* dst, const struct canny_roi *roi, const struct canny_params *params, struct canny_job *job) {
+	decode_image(job, src, dst, roi, params);
+	compute_image(job);
+	encode_image(job);
+}
 
-	start = clock();
 
-	char header[8];
-	png_structp png_read_ptr;
-	png_infop read_info_ptr;
-	png_infop read_end_ptr;
-	png_structp png_write_ptr;
-	png_infop write_info_ptr;
+/*
+    First stage of canny_edge_detection. Opens the files, sets up the read and the write
+    and reads the whole image into job->input. Images that go through the algorithm row
+    by row are only opened here and are read during compute_image. The formats of src
+    and dst come from their extensions, see image_io.c, and only PNG files go through
+    PNG_LIB.
+
+    Everything the image needs until it is written, including the memory of PNG_LIB,
+    comes from the arena of the job, which is emptied here for the new image.
+*/
+void decode_image(struct canny_job *job, char *src, char *dst, const struct canny_roi *roi, const struct canny_params *params) {
+	job->started = profile_start();
+	arena_release(&job->arena, 0);
+	job->params = *params;
 
 	//Open the source and destination file
-	FILE *src_file = fopen(src, "rb");
-	if (src_file == NULL) {
+	job->src_file = fopen(src, "rb");
+	if (job->src_file == NULL) {
 		fprintf(stderr, "Unable to open source file.\n");
 		exit(1);
 	}
-	FILE *dst_file = fopen(dst, "wb");
-	if (dst_file == NULL) {
+	job->dst_file = fopen(dst, "wb");
+	if (job->dst_file == NULL) {
 		fprintf(stderr, "Unable to create destination file.\n");
-		fclose(src_file);
+		fclose(job->src_file);
 		exit(1);
 	}
 
-	//Call library function to set up the information for reading
-	setup_read(src_file, dst_file, &png_read_ptr, &read_info_ptr, &read_end_ptr);
+	job->source_format = image_format(src);
+	job->target_format = image_format(dst);
+	job->png_read_ptr = NULL;
+	job->read_info_ptr = NULL;
+	job->read_end_ptr = NULL;
+	job->png_write_ptr = NULL;
+	job->write_info_ptr = NULL;
+	map_file(job->src_file, &job->source);
+
+	const bool cropped = roi != NULL && roi->width > 0 && roi->height > 0;
+	job->crop.width = 0;
+	job->streamed = false;
+	unsigned width, height;
+	if (job->source_format == FORMAT_PNG) {
+		//Call library function to set up the information for reading
+		setup_read(job->src_file, job->dst_file, &job->png_read_ptr, &job->read_info_ptr, &job->read_end_ptr, &job->arena, &job->source);
+
+		//Determines image features such as height and width
+		setup_info(job->png_read_ptr, job->read_info_ptr);
+
+		width = png_get_rowbytes(job->png_read_ptr, job->read_info_ptr);
+		height = png_get_image_height(job->png_read_ptr, job->read_info_ptr);
+
+		//Images too large to hold whole go through the algorithm row by row instead,
+		//as long as they are written as PNG too
+		job->streamed = !cropped && job->target_format == FORMAT_PNG && (size_t) width * height >= STREAMING_MIN_PIXELS && png_get_interlace_type(job->png_read_ptr, job->read_info_ptr) == PNG_INTERLACE_NONE;
+		if (job->streamed) {
+			profile_record(STAGE_DECODE, job->started);
+			return;
+		}
 
-	//Determines image features such as height and width
-	setup_info(png_read_ptr, read_info_ptr);
+		if (cropped) {
+			decode_region(job, roi, width, height);
+		} else {
+			//Allocate memory to read the image data into
+			allocate_image(&job->input, width, height, &job->arena);
 
-	time_one = clock();
+			//Execute the actual read
+			execute_read(job->png_read_ptr, job->read_info_ptr, job->read_end_ptr, job->input.rows);
+		}
+	} else {
+		//The pixels of raw and PGM files are used where they are mapped
+		read_image(job->src_file, &job->source, job->source_format, &job->input, &job->arena);
+		width = job->input.width;
+		height = job->input.height;
+		if (cropped) {
+			decode_region(job, roi, width, height);
+		}
+	}
 
-	//Allocate memory to read the image data into
-	png_bytep row_pointers[png_get_image_height(png_read_ptr, read_info_ptr)];
-	allocate_read_mem(png_read_ptr, row_pointers, png_get_image_height(png_read_ptr, read_info_ptr), png_get_rowbytes(png_read_ptr, read_info_ptr));
+	if (job->target_format == FORMAT_PNG) {
+		//Call library function to set up the information for writing
+		setup_write(job->src_file, job->dst_file, job->png_read_ptr, job->read_info_ptr, job->read_end_ptr, &job->png_write_ptr, &job->write_info_ptr, &job->arena, options.encoding, options.one_bit);
+		if (cropped || job->png_read_ptr == NULL) {
+			//Images that were not read through PNG_LIB are 8-bit grayscale
+			const int bit_depth = job->png_read_ptr != NULL ? png_get_bit_depth(job->png_write_ptr, job->write_info_ptr) : options.one_bit ? 1 : 8;
+			png_set_IHDR(job->png_write_ptr, job->write_info_ptr, cropped ? job->crop.width : width, cropped ? job->crop.height : height, bit_depth, PNG_COLOR_TYPE_GRAY, png_get_interlace_type(job->png_write_ptr, job->write_info_ptr), PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+		}
+	}
 
-	time_two = clock();
+	profile_record(STAGE_DECODE, job->started);
+}
 
-	//Execute the actual read
-	execute_read(png_read_ptr, read_info_ptr, read_end_ptr, row_pointers);
 
-	//Call library function to set up the information for writing
-	setup_write(src_file, dst_file, png_read_ptr, read_info_ptr, read_end_ptr, &png_write_ptr, &write_info_ptr);   
+/*
+    Reads only the part of the image that the edges inside roi depend on into
+    job->input, which is roi grown by its hysteresis margin and by ROI_HALO pixels for
+    the kernels, clipped to the image. Rows outside that part are decoded one at a time
+    without being kept, so the memory and the time of the rest of the algorithm follow
+    the size of roi instead of the size of the image. job->crop is set to where roi
+    lies within job->input.
+
+    The normalization of the gaussian filter depends on the whole image, so its range
+    is found here over every row, the same way the streaming version does, and left in
+    job->range. The edges inside roi then only differ from the same rectangle of a full
+    run where hysteresis would have followed an edge further than the margin.
+*/
+void decode_region(struct canny_job *job, const struct canny_roi *roi, const unsigned width, const unsigned height) {
+	const unsigned image_width = job->png_read_ptr != NULL ? png_get_image_width(job->png_read_ptr, job->read_info_ptr) : width;
+	if (roi->x >= image_width || roi->y >= height) {
+		arena_failure("Region of interest is outside the image.");
+	}
+	const unsigned extend = roi->margin + ROI_HALO;
+	const unsigned left = roi->x > extend ? roi->x - extend : 0;
+	const unsigned top = roi->y > extend ? roi->y - extend : 0;
+	job->crop.width = roi->width < image_width - roi->x ? roi->width : image_width - roi->x;
+	job->crop.height = roi->height < height - roi->y ? roi->height : height - roi->y;
+	const unsigned right = roi->x + job->crop.width + extend < width ? roi->x + job->crop.width + extend : width;
+	const unsigned bottom = roi->y + job->crop.height + extend < height ? roi->y + job->crop.height + extend : height;
+	job->crop.x = roi->x - left;
+	job->crop.y = roi->y - top;
+	struct gaussian kernel;
+	gaussian_kernel(job->params.sigma, options.fixed_point, &kernel);
+
+	if (job->png_read_ptr == NULL) {
+		//Files of the other formats are already in job->input whole
+		struct image_buffer whole = job->input;
+		convolution_range(&whole, &kernel, &job->range[0], &job->range[1]);
+		view_image(&job->input, &whole, left, top, right - left, bottom - top, &job->arena);
+	} else if (png_get_interlace_type(job->png_read_ptr, job->read_info_ptr) == PNG_INTERLACE_NONE) {
+		allocate_image(&job->input, right - left, bottom - top, &job->arena);
+		streaming_range(job->png_read_ptr, width, height, &kernel, &job->range[0], &job->range[1], &job->input, left, top);
+	} else {
+		//Every pass of an interlaced image covers the whole image, so it is read whole
+		struct image_buffer whole;
+		allocate_image(&whole, width, height, &job->arena);
+		execute_read(job->png_read_ptr, job->read_info_ptr, job->read_end_ptr, whole.rows);
+		convolution_range(&whole, &kernel, &job->range[0], &job->range[1]);
+		view_image(&job->input, &whole, left, top, right - left, bottom - top, &job->arena);
+	}
+}
 
 
+/*
+    Second stage of canny_edge_detection. Runs the four steps of the algorithm on
+    job->input and leaves the edges in job->output. The planes only the steps use come
+    from the arena of the calling thread.
+*/
+void compute_image(struct canny_job *job) {
+	double start = profile_start();
+	if (job->streamed) {
+		streaming_edge_detection(job->src_file, job->dst_file, &job->png_read_ptr, &job->read_info_ptr, &job->read_end_ptr, &job->png_write_ptr, &job->write_info_ptr, &job->params, options.fixed_point, &job->arena, &job->source);
+		profile_record(STAGE_STREAMING, start);
+		return;
+	}
+	const unsigned width = job->input.width;
+	const unsigned height = job->input.height;
+	const float *range = job->crop.width > 0 ? job->range : NULL;
+	struct arena *scratch = thread_arena();
+	const size_t mark = arena_mark(scratch);
+
 	//Allocate memory to perform for the various steps of the algorithm
-	png_bytep output_pointers[png_get_image_height(png_read_ptr, read_info_ptr)];
-	png_bytep Gy_applied[png_get_image_height(png_read_ptr, read_info_ptr)];
-	png_bytep Gx_applied[png_get_image_height(png_read_ptr, read_info_ptr)];
-	png_bytep nms[png_get_image_height(png_read_ptr, read_info_ptr)];
-	png_bytep final_output[png_get_image_height(png_read_ptr, read_info_ptr)];
-
-	time_three = clock();
-	
-	//Allocate the actual memory
-	allocate_write_mem(png_write_ptr, output_pointers, Gy_applied, Gx_applied, nms, final_output, png_get_image_height(png_read_ptr, read_info_ptr), png_get_rowbytes(png_read_ptr, read_info_ptr));
-
-	//Allocate enough space for intermediate arrays
-	float *G = calloc(png_get_rowbytes(png_read_ptr, read_info_ptr) * png_get_image_height(png_read_ptr, read_info_ptr), sizeof(float));
-	float *dir = calloc(png_get_rowbytes(png_read_ptr, read_info_ptr) * png_get_image_height(png_read_ptr, read_info_ptr), sizeof(float));
-
-	time_four = clock();
-	
+	struct image_buffer nms;
+	allocate_image(&nms, width, height, scratch);
+	allocate_image(&job->output, width, height, &job->arena);
+
 	//The four steps for the canny edge detection.
-	gaussian_filter(row_pointers, output_pointers, png_get_rowbytes(png_read_ptr, read_info_ptr), png_get_image_height(png_read_ptr, read_info_ptr), .99);
-	time_five = clock();
-	
-	intensity_gradients(output_pointers, Gx_applied, Gy_applied, G, dir, png_get_rowbytes(png_read_ptr, read_info_ptr), png_get_image_height(png_read_ptr, read_info_ptr));
-	time_six = clock();
-	
-	non_maximum_suppression(nms, G, dir, png_get_rowbytes(png_read_ptr, read_info_ptr), png_get_image_height(png_read_ptr, read_info_ptr));
-	time_seven = clock();
-	
-	hysteresis(final_output, nms, png_get_rowbytes(png_read_ptr, read_info_ptr), png_get_image_height(png_read_ptr, read_info_ptr), 105, 45);
-	time_eight = clock();
-	
-	free(G);
-	free(dir);
-	
-	//Complete the actual write
-	execute_write(png_write_ptr, write_info_ptr, final_output);
-
-
-	//Clear memory allocated for reading and writing
-	cleanup_rows(png_write_ptr, output_pointers, Gy_applied, Gx_applied, nms, final_output, png_read_ptr, row_pointers, png_get_image_height(png_read_ptr, read_info_ptr));
+	if (options.pyramid_levels > 1) {
+		pyramid_edge_detection(&job->input, &nms, job->params.sigma, options.fixed_point, options.pyramid_levels, job->params.low, range);
+	} else if ((size_t) width * height >= TILED_MIN_PIXELS) {
+		//The first three steps run tile by tile so they only go through memory once
+		start = profile_start();
+		tiled_pipeline(&job->input, &nms, job->params.sigma, options.fixed_point, range);
+		profile_record(STAGE_TILED, start);
+	} else {
+		struct image_buffer output;
+		allocate_image(&output, width, height, scratch);
+		float *G = arena_calloc(scratch, (size_t) width * height * sizeof(float));
+		png_bytep dir = arena_calloc(scratch, (size_t) width * height * sizeof(png_byte));
+
+		start = profile_start();
+		gaussian_filter(&job->input, &output, job->params.sigma, options.fixed_point, range);
+		profile_record(STAGE_GAUSSIAN, start);
+
+		start = profile_start();
+		intensity_gradients(&output, G, dir);
+		profile_record(STAGE_GRADIENTS, start);
+
+		start = profile_start();
+		non_maximum_suppression(&nms, G, dir);
+		profile_record(STAGE_SUPPRESSION, start);
+	}
+
+	start = profile_start();
+	hysteresis(&job->output, &nms, job->params.high, job->params.low);
+	profile_record(STAGE_HYSTERESIS, start);
 
+	arena_release(scratch, mark);
+}
 
 
-	//Clear memory alloacted by the library
-	cleanup_struct_mem(png_read_ptr, read_info_ptr, read_end_ptr, png_write_ptr, write_info_ptr);
+/*
+    Last stage of canny_edge_detection. Writes job->output, destroys the PNG_LIB structs
+    and closes the files. The memory stays in the arena of the job for the next image.
+    A write that fails, including one that only fails when dst_file is flushed or
+    closed, goes through arena_failure, so a server answers it as an error.
+*/
+void encode_image(struct canny_job *job) {
+	const double start = profile_start();
+	struct image_buffer output = job->output;
+	if (job->crop.width > 0) {
+		//Only the region of interest is written, starting at its left edge
+		view_image(&output, &job->output, job->crop.x, job->crop.y, job->crop.width, job->crop.height, &job->arena);
+	} else if (job->png_read_ptr != NULL) {
+		//Rows of a PNG are rowbytes wide, but like PNG_LIB the other formats only take
+		//the first pixel of each
+		output.width = png_get_image_width(job->png_read_ptr, job->read_info_ptr);
+	}
+	if (job->target_format != FORMAT_PNG) {
+		write_image(job->dst_file, job->target_format, &output, &job->arena);
+	} else if (!job->streamed && options.encoding == ENCODE_SMALL) {
+		execute_write_smallest(job->png_write_ptr, job->write_info_ptr, output.rows, job->dst_file, &job->arena);
+	} else if (!job->streamed) {
+		//Complete the actual write
+		execute_write(job->png_write_ptr, job->write_info_ptr, output.rows);
+	}
 
+	//Clear memory alloacted by the library
+	cleanup_struct_mem(job->png_read_ptr, job->read_info_ptr, job->read_end_ptr, job->png_write_ptr, job->write_info_ptr);
 
 	//Close out the files
-	fclose(src_file);
-	fclose(dst_file);
-
-	time_nine = clock();
-	
-	end = clock();
-	double time_total = (((double) (end - start)) / CLOCKS_PER_SEC);
-	double per_1 = (((double) (time_one - start)) / CLOCKS_PER_SEC) / time_total * 100;
-	double per_2 = (((double) (time_two - time_one)) / CLOCKS_PER_SEC) / time_total * 100;
-	double per_3 = (((double) (time_three - time_two)) / CLOCKS_PER_SEC) / time_total * 100;
-	double per_4 = (((double) (time_four - time_three)) / CLOCKS_PER_SEC) / time_total * 100;
-	double per_5 = (((double) (time_five - time_four)) / CLOCKS_PER_SEC) / time_total * 100;
-	double per_6 = (((double) (time_six - time_five)) / CLOCKS_PER_SEC) / time_total * 100;
-	double per_7 = (((double) (time_seven - time_six)) / CLOCKS_PER_SEC) / time_total * 100;
-	double per_8 = (((double) (time_eight - time_seven)) / CLOCKS_PER_SEC) / time_total * 100;
-	double per_9 = (((double) (time_nine - time_eight)) / CLOCKS_PER_SEC) / time_total * 100;
-	fprintf(stderr, "%s", "=============================================\n");
-	fprintf(stderr, "%s %f %s" ,"Total process took:", time_total, "\n");
-	fprintf(stderr, "%s %f %s" ,"Setup:", per_1, "%% \n");
-	fprintf(stderr, "%s %f %s" ,"Allocate Read:", per_2, "%% \n");
-	fprintf(stderr, "%s %f %s" ,"Execute Read and Setup Write:", per_3, "%% \n");
-	fprintf(stderr, "%s %f %s" ,"Allocate Write:", per_4, "%% \n");
-	fprintf(stderr, "%s %f %s" ,"Gaussian:", per_5, "%% \n");
-	fprintf(stderr, "%s %f %s" ,"Intensity Gradients:", per_6, "%% \n");
-	fprintf(stderr, "%s %f %s" ,"Non-maximum Suppression:", per_7, "%% \n");
-	fprintf(stderr, "%s %f %s" ,"Hysteresis:", per_8, "%% \n");
-	fprintf(stderr, "%s %f %s" ,"Cleanup:", per_9, "%% \n");
+	unmap_file(&job->source);
+	fclose(job->src_file);
+	job->src_file = NULL;
+	bool failed = fflush(job->dst_file) != 0 || ferror(job->dst_file);
+	failed |= fclose(job->dst_file) != 0;
+	job->dst_file = NULL;
+	if (failed) {
+		arena_failure("Failed to write the output file.");
+	}
+
+	profile_record(STAGE_ENCODE, start);
+	profile_record(STAGE_IMAGE, job->started);
 }
 
 
@@ -228,12 +395,76 @@ void canny_edge_detection(char* src, char* dst) {
     https://en.wikipedia.org/wiki/Canny_edge_detector
 
     C comments can't do the formula format justice
+
+    The result is normalized with range, the minimum and the maximum of the filter
+    before normalizing, or with the range of input itself when range is NULL.
+*/
+void gaussian_filter(struct image_buffer *input, struct image_buffer *output, const float sigma, const bool fixed, const float *range) {
+	struct gaussian kernel;
+	gaussian_kernel(sigma, fixed, &kernel);
+	separable_convolution(input, output, &kernel, range);
+}
+
+
+/*
+    Fills kernel with the 1D gaussian kernel for sigma in the precision given by fixed.
+    The kernel is taken from gaussian_table or from the kernels built earlier in the
+    run, so an image only pays for building it when its sigma is new. Both precisions
+    are built together, which makes the cache key the sigma alone. When the cache is
+    full the kernel is built without being stored. gaussian_table never changes, so
+    only a sigma that is not in it takes gaussian_lock.
 */
-void gaussian_filter(png_bytep *input, png_bytep *output, const unsigned width, const unsigned height, const float sigma) {
-	
-	time_t start, mid, end;
-	start = clock();
+void gaussian_kernel(const float sigma, const bool fixed, struct gaussian *kernel) {
+	const unsigned entries = sizeof(gaussian_table) / sizeof(gaussian_table[0]);
+	const struct gaussian *found = NULL;
+	for (unsigned i = 0; i < entries && found == NULL; i++) {
+		if (gaussian_table[i].sigma == sigma) {
+			found = &gaussian_table[i];
+		}
+	}
+	if (found != NULL) {
+		*kernel = *found;
+	} else {
+		pthread_mutex_lock(&gaussian_lock);
+		for (unsigned i = 0; i < gaussian_cached && found == NULL; i++) {
+			if (gaussian_cache[i].sigma == sigma) {
+				found = &gaussian_cache[i];
+			}
+		}
+		if (found == NULL && gaussian_cached < GAUSSIAN_CACHE_SIZE) {
+			build_gaussian_kernel(sigma, &gaussian_cache[gaussian_cached]);
+			found = &gaussian_cache[gaussian_cached++];
+		}
+		if (found != NULL) {
+			*kernel = *found;
+		}
+		pthread_mutex_unlock(&gaussian_lock);
+		if (found == NULL) {
+			build_gaussian_kernel(sigma, kernel);
+		}
+	}
+	kernel->fixed = fixed;
+	kernel->element = fixed ? sizeof(int16_t) : sizeof(float);
+}
+
 
+/*
+    Builds the 1D gaussian kernel for sigma, whose size is at most GAUSSIAN_MAX_SIZE,
+    in both precisions. The 2D kernel is the outer product of this kernel with
+    itself. The constant factor of the 2D formula is dropped since the result of the
+    convolution is normalized anyway.
+
+    For the fixed point filter the weights are also rounded to integers that add up to
+    exactly 1 << GAUSSIAN_FIXED_BITS, with the rounding error of the sum taken off the
+    largest weight. That keeps every horizontally filtered pixel within a signed 16-bit
+    value and every vertically filtered one exact in a float.
+
+    Rounding the weights moves some blurred pixels by a level after normalization. On
+    the 30 test images 0.1% of the output pixels change, and every image stays within
+    the check-correctness limit of 5% more errors than naive (the worst, oski, goes
+    from 4.90% to 4.94%).
+*/
+void build_gaussian_kernel(const float sigma, struct gaussian *kernel) {
 	unsigned n;
 	if (sigma < 0.5) {
 		n = 3;
@@ -249,123 +480,369 @@ void gaussian_filter(png_bytep *input, png_bytep *output, const unsigned width,
 		n = 13;
 	}
 	const float k = (n - 1) / 2.0;
-	const float two_pi_sgma_sqrd = (2 * M_PI * sigma * sigma);
 	const float two_sgma_sqrd = (2 * sigma * sigma);
-	float kernel[n * n];
-
-	#pragma omp parallel for collapse(2)
-	for (unsigned j = 0; j < n; j++) {
-		
-		for (unsigned i = 0; i < n; i++) {
-			kernel[j + i*n] = exp(((pow((i - (k + 1)), 2.0) + pow((j - (k + 1)), 2.0))) / two_sgma_sqrd) / two_pi_sgma_sqrd;
+	float *weights = kernel->weights;
+	float sum = 0;
+	for (unsigned i = 0; i < n; i++) {
+		weights[i] = exp(pow((i - (k + 1)), 2.0) / two_sgma_sqrd);
+		sum += weights[i];
+	}
+	for (unsigned i = 0; i < n; i++) {
+		weights[i] /= sum;
+	}
+	kernel->sigma = sigma;
+	kernel->size = n;
+	kernel->fixed = false;
+	kernel->element = sizeof(float);
+
+	int fixed_sum = 0;
+	unsigned largest = 0;
+	for (unsigned i = 0; i < n; i++) {
+		kernel->fixed_weights[i] = lrintf(weights[i] * (1 << GAUSSIAN_FIXED_BITS));
+		fixed_sum += kernel->fixed_weights[i];
+		if (weights[i] > weights[largest]) {
+			largest = i;
 		}
 	}
+	kernel->fixed_weights[largest] += (1 << GAUSSIAN_FIXED_BITS) - fixed_sum;
+}
 
-	mid = clock();
 
-	convolution(input, output, kernel, width, height, n, true);
+/*
+    Horizontal pass of the gaussian filter kernel in whichever precision it was made
+    for. output is a row of kernel->element sized values.
+*/
+void gaussian_pass_h(struct gaussian *kernel, png_bytep input, void *output, const unsigned width) {
+	if (kernel->fixed) {
+		simd.gaussian_row_h_fixed(input, output, kernel->fixed_weights, width, kernel->size);
+	} else {
+		simd.gaussian_row_h(input, output, kernel->weights, width, kernel->size);
+	}
+}
 
-	end = clock();
 
-	double per_1 = (((double) (mid - start)) / CLOCKS_PER_SEC) / (((double) (end - start)) / CLOCKS_PER_SEC) * 100;
-	double per_2 = (((double) (end - mid)) / CLOCKS_PER_SEC) / (((double) (end - start)) / CLOCKS_PER_SEC) * 100;
-	fprintf(stderr, "%s" ,"///////////////////////\n");
-	fprintf(stderr, "%s" ,"Gaussian Time Analysis:\n");
-	fprintf(stderr, "%s %f %s" ,"Main Gaussian:", per_1, "%% \n");
-	fprintf(stderr, "%s %f %s" ,"Convolution:", per_2, "%% \n");
-	fprintf(stderr, "%s" ,"\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\ \n");
+/*
+    Vertical pass of the gaussian filter kernel over rows made by gaussian_pass_h. Both
+    precisions produce floats so the range and the normalization are shared.
+*/
+void gaussian_pass_v(struct gaussian *kernel, void **rows, float *output, const unsigned width) {
+	if (kernel->fixed) {
+		simd.gaussian_row_v_fixed((int16_t **) rows, output, kernel->fixed_weights, width, kernel->size);
+	} else {
+		simd.gaussian_row_v((float **) rows, output, kernel->weights, width, kernel->size);
+	}
 }
 
 
 /*
-    Performs a convolution of the input and a specified kernel.
-    If you are curious about what a convolution is, look at 
-    https://en.wikipedia.org/wiki/Convolution
-    but for our purposes we can think of it as a transformation
-    on the input using the kernel.
+    Performs a normalized convolution of the input with the outer product of kernel
+    with itself, as a horizontal pass followed by a vertical pass so each pixel costs
+    2 * z multiply-adds instead of z * z. Each thread filters one band of rows with
+    convolution_band. range overrides the range found along the way, see
+    gaussian_filter. The ring buffers of the threads are allocated before the parallel
+    region, so running out of memory happens on the calling thread, where it can be
+    recovered from.
 */
-float pixel;
-void convolution(png_bytep *input, png_bytep *output, float *kernel, const unsigned width, const unsigned height, const int z, const bool normalize) {
+void separable_convolution(struct image_buffer *input, struct image_buffer *output, struct gaussian *kernel, const float *range) {
+	const unsigned width = input->width;
+	const unsigned height = input->height;
+	const int z = kernel->size;
+	const int half = z / 2;
+	if (width < z || height < z) {
+		return;
+	}
+	const unsigned pixels_width = width - 2 * half;
+	const unsigned pixels_height = height - 2 * half;
+	struct arena *scratch = thread_arena();
+	const size_t mark = arena_mark(scratch);
+	float *pixels = arena_alloc(scratch, (size_t) pixels_width * pixels_height * sizeof(float));
+	const unsigned max_threads = omp_get_max_threads();
+	png_bytep rings[max_threads];
+	for (unsigned t = 0; t < max_threads; t++) {
+		rings[t] = arena_alloc(scratch, z * width * kernel->element);
+	}
+	float min = FLT_MAX, max = -FLT_MAX;
 
+	#pragma omp parallel num_threads(max_threads) reduction(min : min) reduction(max : max)
+	{
+		const unsigned threads = omp_get_num_threads();
+		const unsigned thread = omp_get_thread_num();
+		const unsigned band = (pixels_height + threads - 1) / threads;
+		const unsigned first = half + thread * band;
+		const unsigned last = first + band < height - half ? first + band : height - half;
+		if (first < last) {
+			convolution_band(input, kernel, first, last, pixels + (size_t) (first - half) * pixels_width, pixels_width, &min, &max, rings[thread]);
+		}
+	}
+	if (range != NULL) {
+		min = range[0];
+		max = range[1];
+	}
+
+	#pragma omp parallel for
+	for (unsigned n = half; n < height - half; n++) {
+		simd.normalize_row(pixels + (size_t) (n - half) * pixels_width, output->data + (size_t) n * output->stride + half, pixels_width, min, max);
+	}
+	arena_release(scratch, mark);
+}
+
+
+/*
+    Finds the range of the separable convolution of the input without storing it. This
+    is the first pass of the tiled pipeline, which needs the range before any tile can
+    be normalized. Like in separable_convolution the rows and ring buffers of the
+    threads come from the calling thread.
+*/
+void convolution_range(struct image_buffer *input, struct gaussian *kernel, float *range_min, float *range_max) {
+	const unsigned width = input->width;
+	const unsigned height = input->height;
+	const int z = kernel->size;
 	const int half = z / 2;
 	float min = FLT_MAX, max = -FLT_MAX;
-	if (normalize) {
-			unsigned pixels_width = width - 2 * half;
-			unsigned pixels_height = height - 2 * half;
-			float *pixels = malloc((pixels_width) * (pixels_height) * sizeof(float));
-			//#pragma omp for collapse(2)
-			#pragma omp parallel for reduction (+ : pixel)
-			for (int m = half; m < width - half; m++) {
-        		for (int n = half; n < height - half; n++) {
-            			pixel = 0.0;
-            			size_t c = 0;
-            			for (int i = -half; i <= half; i++) {
-            				//#pragma omp for reduction(+ : pixel)
-                			for (int j = -half; j <= half; j++) {
-            	    			pixel += input[(n - j) + (m - i) / width][(m - i) % width] * kernel[c];
-            	    			c++;
-                			}
-            			}
-            			if (pixel < min) {
-                			min = pixel;
-            			}
-            			if (pixel > max) {
-                			max = pixel;
-            			}
-
-            			pixels[(n - half) * pixels_width + (m - half)] = pixel;
-        		}
-    		}
-
-    		#pragma omp parallel for
-		  	for (int m = half; m < width - half; m++) {
-		  		for (int n = half; n < height - half; n++) {
-					
-					output[n][m] = (png_byte) MAX_BRIGHTNESS * (pixels[(n - half) * pixels_width + (m - half)] - min) / (max - min);
-				}
-			}
+	if (width < z || height < z) {
+		*range_min = min;
+		*range_max = max;
+		return;
+	}
+	const unsigned pixels_width = width - 2 * half;
+	const unsigned pixels_height = height - 2 * half;
+	struct arena *scratch = thread_arena();
+	const size_t mark = arena_mark(scratch);
+	const unsigned max_threads = omp_get_max_threads();
+	float *rows[max_threads];
+	png_bytep rings[max_threads];
+	for (unsigned t = 0; t < max_threads; t++) {
+		rows[t] = arena_alloc(scratch, pixels_width * sizeof(float));
+		rings[t] = arena_alloc(scratch, z * width * kernel->element);
+	}
 
-			free(pixels);
-			
-  	} else {
-	  	//#pragma omp for collapse(2)
-	  	#pragma omp parallel for reduction (+ : pixel)
-	  	for (int m = half; m < width - half; m++) {
-	  		for (int n = half; n < height - half; n++) {
-				pixel = 0.0;
-				size_t c = 0;
-
-				for (int i = -half; i <= half; i++) {
-				//#pragma omp for reduction(+ : pixel)
-					for (int j = -half; j <= half; j++) {
-						pixel += input[(n - j) + (m - i) / width][(m - i) % width] * kernel[c];
-						c++;
-					}
-				}
-				output[n][m] = (png_byte) pixel;
-			}
+	#pragma omp parallel num_threads(max_threads) reduction(min : min) reduction(max : max)
+	{
+		const unsigned threads = omp_get_num_threads();
+		const unsigned thread = omp_get_thread_num();
+		const unsigned band = (pixels_height + threads - 1) / threads;
+		const unsigned first = half + thread * band;
+		const unsigned last = first + band < height - half ? first + band : height - half;
+		if (first < last) {
+			convolution_band(input, kernel, first, last, rows[thread], 0, &min, &max, rings[thread]);
 		}
 	}
+	arena_release(scratch, mark);
+	*range_min = min;
+	*range_max = max;
 }
 
+
 /*
-    Takes two known matrices and performs convolutions on them with the output of the previous
-    step (the input to this function). The Gradient G is calculated using the two convolutions
-    and the angles can be calculated using the arctan of the two convultion results.
+    Filters the output rows first to last - 1 of the separable convolution into output,
+    advancing output_stride floats per row, and lowers *band_min and raises *band_max
+    to cover them. A stride of 0 keeps only the range. ring holds the z horizontally
+    filtered rows, z * width * kernel->element bytes.
+
+    The band walks the image row by row and keeps the last z horizontally filtered rows
+    in a ring buffer, so every input row is filtered horizontally once and the vertical
+    pass reads straight out of the ring through the window of row pointers. While a row
+    is filtered the next input row is prefetched, so its first cache lines are on the
+    way before the horizontal pass reaches it.
 */
-void intensity_gradients(png_bytep *output, png_bytep *Gx_applied, png_bytep *Gy_applied, float *G, float *dir, const unsigned width, const unsigned height) {
-	float Gx[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
-	float Gy[] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
-	convolution(output, Gx_applied, Gx, width, height, 3, false);
-	convolution(output, Gy_applied, Gx, width, height, 3, false);
-	#pragma omp parallel for
-	for (int j = 1; j < height - 1; j++) {
-		for (int i = 1; i < width - 1; i++) {
-			int c = i + width * j;
-			G[c] = hypot(Gx_applied[j][i], Gy_applied[j][i]);
-			dir[c] = (float)(fmod(atan2(Gy_applied[j][i], Gx_applied[j][i]) + M_PI, M_PI) / M_PI) * 8;  
+void convolution_band(struct image_buffer *input, struct gaussian *kernel, const unsigned first, const unsigned last, float *output, const unsigned output_stride, float *band_min, float *band_max, png_bytep ring) {
+	const unsigned width = input->width;
+	const unsigned height = input->height;
+	const int z = kernel->size;
+	const int half = z / 2;
+	const unsigned row_size = width * kernel->element;
+	const unsigned pixels_width = width - 2 * half;
+	float min = *band_min, max = *band_max;
+	void *window[z];
+
+	//Prime the ring with the rows above the first output row of the band
+	for (unsigned row = first - half; row < first + half; row++) {
+		gaussian_pass_h(kernel, input->data + (size_t) row * input->stride, ring + (row % z) * row_size, width);
+	}
+	for (unsigned n = first; n < last; n++, output += output_stride) {
+		if (n + half + 1 < height) {
+			prefetch_row(input->data + (size_t) (n + half + 1) * input->stride, width);
+		}
+		gaussian_pass_h(kernel, input->data + (size_t) (n + half) * input->stride, ring + ((n + half) % z) * row_size, width);
+		for (int j = 0; j < z; j++) {
+			window[j] = ring + ((n + half - j) % z) * row_size;
 		}
+		gaussian_pass_v(kernel, window, output, width);
+		simd.range_row(output, pixels_width, &min, &max);
 	}
+	*band_min = min;
+	*band_max = max;
+}
+
+
+/*
+    Asks for the bytes of a row to be brought into the cache ahead of their use.
+*/
+void prefetch_row(png_bytep row, const unsigned bytes) {
+	for (unsigned offset = 0; offset < bytes; offset += 64) {
+		_mm_prefetch((const char *) row + offset, _MM_HINT_T0);
+	}
+}
+
+
+/*
+    Lowers *min and raises *max to cover count convolution results. Taking the minimum
+    and the maximum is exact, so the order the values are seen in does not matter.
+*/
+void range_row(float *input, const unsigned count, float *min, float *max) {
+	for (unsigned m = 0; m < count; m++) {
+		if (input[m] < *min) {
+			*min = input[m];
+		}
+		if (input[m] > *max) {
+			*max = input[m];
+		}
+	}
+}
+
+
+/*
+    Scales count convolution results from [min, max] to [0, MAX_BRIGHTNESS]. min and max
+    are the range of the whole image, which every band reduces into before any row is
+    scaled, so the output does not depend on the number of threads.
+*/
+void normalize_row(float *input, png_bytep output, const unsigned count, const float min, const float max) {
+	for (unsigned m = 0; m < count; m++) {
+		output[m] = (png_byte) MAX_BRIGHTNESS * (input[m] - min) / (max - min);
+	}
+}
+
+
+/*
+    Horizontal pass of the separable convolution. Only the columns at least z / 2
+    from either edge are written.
+*/
+void gaussian_row_h(png_bytep input, float *output, float *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	for (unsigned m = half; m < width - half; m++) {
+		float pixel = 0.0;
+		for (int i = 0; i < z; i++) {
+			pixel += input[m + half - i] * kernel[i];
+		}
+		output[m] = pixel;
+	}
+}
+
+
+/*
+    Vertical pass of the separable convolution. rows[j] holds the horizontally
+    filtered row j - z / 2 above the output row. The output row only holds the
+    interior columns, so column m is written to output[m - z / 2].
+*/
+void gaussian_row_v(float **rows, float *output, float *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	for (unsigned m = half; m < width - half; m++) {
+		float pixel = 0.0;
+		for (int j = 0; j < z; j++) {
+			pixel += rows[j][m] * kernel[j];
+		}
+		output[m - half] = pixel;
+	}
+}
+
+
+/*
+    Fixed point version of gaussian_row_h. The pixels and the weights are small enough
+    that the sums fit in 16 bits, see gaussian_kernel.
+*/
+void gaussian_row_h_fixed(png_bytep input, int16_t *output, int16_t *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	for (unsigned m = half; m < width - half; m++) {
+		int16_t pixel = 0;
+		for (int i = 0; i < z; i++) {
+			pixel += input[m + half - i] * kernel[i];
+		}
+		output[m] = pixel;
+	}
+}
+
+
+/*
+    Fixed point version of gaussian_row_v. The sums are kept in 32 bits and are exact
+    when turned into floats since they stay below 1 << 24.
+*/
+void gaussian_row_v_fixed(int16_t **rows, float *output, int16_t *kernel, const unsigned width, const int z) {
+	const int half = z / 2;
+	for (unsigned m = half; m < width - half; m++) {
+		int32_t pixel = 0;
+		for (int j = 0; j < z; j++) {
+			pixel += rows[j][m] * kernel[j];
+		}
+		output[m - half] = pixel;
+	}
+}
+
+
+/*
+    Computes the gradient of the output of the previous step (the input to this function)
+    with the Sobel operators in a single pass. Each 3x3 neighbourhood is read once and
+    turned straight into the magnitude G and the direction sector dir that non maximum
+    suppression needs.
+*/
+void intensity_gradients(struct image_buffer *input, float *G, png_bytep dir) {
+	const unsigned width = input->width;
+	const unsigned height = input->height;
+	const unsigned stride = input->stride;
+	if (width < 3 || height < 3) {
+		return;
+	}
+	#pragma omp parallel for
+	for (unsigned n = 1; n < height - 1; n++) {
+		png_bytep rows[3] = {input->data + (size_t) (n - 1) * stride, input->data + (size_t) n * stride, input->data + (size_t) (n + 1) * stride};
+		simd.gradient_row(rows, G + (size_t) n * width, dir + (size_t) n * width, width);
+	}
+}
+
+
+/*
+    Row kernel of intensity_gradients. rows holds the rows above, at and below the
+    output row.
+
+    The reference outputs were produced by applying the Gx operator for both the x
+    and the y response and truncating each response to a byte, so this does the same
+    to stay comparable with them.
+*/
+void gradient_row(png_bytep *rows, float *G, png_bytep dir, const unsigned width) {
+	for (unsigned m = 1; m < width - 1; m++) {
+		int above = rows[0][m - 1] + 2 * rows[0][m] + rows[0][m + 1];
+		int below = rows[2][m - 1] + 2 * rows[2][m] + rows[2][m + 1];
+		int gx = (png_byte) (above - below);
+		int gy = gx;
+		G[m] = sqrtf(gx * gx + gy * gy);
+		dir[m] = gradient_sector(gx, gy);
+	}
+}
+
+
+/*
+    Quantizes the direction of the gradient (gx, gy) to one of the four sectors
+    centered on 0, 45, 90 and 135 degrees. This is the same bucketing as taking
+    atan2(gy, gx) modulo 180 degrees and splitting it at 22.5, 67.5, 112.5 and
+    157.5 degrees, without calling atan2.
+
+    With ax = |gx| and ay = |gy| the boundaries are ay = ax * tan(22.5) = ax * (sqrt(2) - 1)
+    and ay = ax * tan(67.5) = ax * (sqrt(2) + 1). Moving ax over and squaring both
+    sides, which are never negative, turns them into the exact integer tests
+    (ax + ay)^2 <= 2 ax^2 and ay > ax with (ay - ax)^2 > 2 ax^2. For every gradient the
+    Sobel operator can produce these give the same sectors as comparing against the
+    rounded float tangents did, and the SIMD versions in simd.c use the same tests.
+*/
+png_byte gradient_sector(const int gx, const int gy) {
+	const int ax = abs(gx);
+	const int ay = abs(gy);
+	if ((ax + ay) * (ax + ay) <= 2 * ax * ax) {
+		return SECTOR_0;
+	} else if (ay > ax && (ay - ax) * (ay - ax) > 2 * ax * ax) {
+		return SECTOR_90;
+	} else if ((gx < 0) == (gy < 0)) {
+		return SECTOR_45;
+	}
+	return SECTOR_135;
 }
 
 
@@ -374,149 +851,743 @@ void intensity_gradients(png_bytep *output, png_bytep *Gx_applied, png_bytep *Gy
     the direction of the gradient. Then checks if in the direction of the gradient (given by
     dir) it is a local maximum. If it is the value remains on, otherwise it is turned off.
 */
-void non_maximum_suppression(png_bytep *nms, float *G, float *dir, const unsigned width, const unsigned height) {
+void non_maximum_suppression(struct image_buffer *nms, float *G, png_bytep dir) {
+	const unsigned width = nms->width;
+	const unsigned height = nms->height;
+	const unsigned stride = nms->stride;
+	if (width < 3 || height < 3) {
+		return;
+	}
+	#pragma omp parallel for
+	for (unsigned j = 1; j < height - 1; j++) {
+		float *rows[3] = {G + (size_t) (j - 1) * width, G + (size_t) j * width, G + (size_t) (j + 1) * width};
+		simd.suppression_row(rows, dir + (size_t) j * width, nms->data + (size_t) j * stride, width);
+	}
+}
+
+
+/*
+    Row kernel of non_maximum_suppression. G holds the gradient rows above, at and below
+    the output row.
+*/
+void suppression_row(float **G, png_bytep dir, png_bytep nms, const unsigned width) {
+	for (unsigned m = 1; m < width - 1; m++) {
+		nms[m] = suppress_pixel(G, dir[m], m);
+	}
+}
+
+
+/*
+    Returns the NMS value of pixel m of the middle row of G, whose gradient points into
+    sector. The two neighbours across the edge are picked from tables indexed by the
+    sector instead of branching on it, and the magnitude is truncated to a byte when it
+    is kept.
+*/
+png_byte suppress_pixel(float **G, const png_byte sector, const unsigned m) {
+	static const int first_row[4] = {1, 0, 0, 0};
+	static const int first_offset[4] = {-1, 1, 0, -1};
+	static const int second_row[4] = {1, 2, 2, 2};
+	static const int second_offset[4] = {1, -1, 0, 1};
+	const float c = G[1][m];
+	const bool kept = c > G[first_row[sector]][m + first_offset[sector]] && c > G[second_row[sector]][m + second_offset[sector]];
+	return kept ? (png_byte) (int) c : 0;
+}
+
+
+/*
+    Multi-scale version of the first three steps, run when -m asks for more than one
+    level. The blurred image is halved up to levels - 1 times by averaging 2x2 blocks,
+    which gives an octave pyramid without filtering again, and the gradients and NMS
+    run on every level from the coarsest up. Only a pixel with an NMS response of at
+    least tmin somewhere among the 3x3 coarser pixels around its parent keeps its own
+    response, so edges have to show up at every scale to survive into nms, where
+    hysteresis then runs as usual.
+
+    The coarse levels are also what makes this cheap. The gradients and NMS of a row
+    only run when the coarser level has a response near it, so rows of a level with no
+    edges are decided after a quarter of the work, and all the levels above the finest
+    together cost a third of it.
+*/
+void pyramid_edge_detection(struct image_buffer *input, struct image_buffer *nms, const float sigma, const bool fixed, const unsigned levels, const unsigned tmin, const float *range) {
+	const unsigned width = input->width;
+	const unsigned height = input->height;
+	struct arena *scratch = thread_arena();
+	const size_t mark = arena_mark(scratch);
+	struct image_buffer blurred[PYRAMID_MAX_LEVELS];
+	struct image_buffer suppressed[PYRAMID_MAX_LEVELS];
+
+	double start = profile_start();
+	allocate_image(&blurred[0], width, height, scratch);
+	gaussian_filter(input, &blurred[0], sigma, fixed, range);
+	profile_record(STAGE_GAUSSIAN, start);
+
+	start = profile_start();
+	unsigned count = 1;
+	while (count < levels && count < PYRAMID_MAX_LEVELS && blurred[count - 1].width / 2 >= 3 && blurred[count - 1].height / 2 >= 3) {
+		allocate_image(&blurred[count], blurred[count - 1].width / 2, blurred[count - 1].height / 2, scratch);
+		downsample_image(&blurred[count - 1], &blurred[count]);
+		count++;
+	}
+	suppressed[0] = *nms;
+	float *G = arena_alloc(scratch, (size_t) width * height * sizeof(float));
+	png_bytep dir = arena_alloc(scratch, (size_t) width * height);
+	bool *supported = arena_alloc(scratch, height * sizeof(bool));
+	for (unsigned k = count; k-- > 0; ) {
+		if (k > 0) {
+			allocate_image(&suppressed[k], blurred[k].width, blurred[k].height, scratch);
+		}
+		if (k == count - 1) {
+			memset(supported, true, blurred[k].height * sizeof(bool));
+		} else {
+			pyramid_support(&suppressed[k + 1], supported, blurred[k].height, tmin);
+		}
+		pyramid_level(&blurred[k], &suppressed[k], G, dir, supported);
+		if (k < count - 1) {
+			pyramid_gate(&suppressed[k], &suppressed[k + 1], tmin);
+		}
+	}
+	profile_record(STAGE_PYRAMID, start);
+	arena_release(scratch, mark);
+}
+
+
+/*
+    Halves input into output, each output pixel the rounded average of a 2x2 block.
+*/
+void downsample_image(struct image_buffer *input, struct image_buffer *output) {
+	#pragma omp parallel for
+	for (unsigned j = 0; j < output->height; j++) {
+		png_bytep top = input->data + 2 * (size_t) j * input->stride;
+		png_bytep bottom = top + input->stride;
+		png_bytep row = output->data + (size_t) j * output->stride;
+		for (unsigned i = 0; i < output->width; i++) {
+			row[i] = (top[2 * i] + top[2 * i + 1] + bottom[2 * i] + bottom[2 * i + 1] + 2) / 4;
+		}
+	}
+}
+
+
+/*
+    Marks which of the height rows of the next finer level are near a response of at
+    least tmin in coarse, the NMS of the level above it.
+*/
+void pyramid_support(struct image_buffer *coarse, bool *supported, const unsigned height, const unsigned tmin) {
+	bool found[coarse->height];
+	#pragma omp parallel for
+	for (unsigned r = 0; r < coarse->height; r++) {
+		png_bytep row = coarse->data + (size_t) r * coarse->stride;
+		found[r] = false;
+		for (unsigned i = 0; i < coarse->width && !found[r]; i++) {
+			found[r] = row[i] >= tmin;
+		}
+	}
+	for (unsigned j = 0; j < height; j++) {
+		const unsigned r = j / 2 < coarse->height ? j / 2 : coarse->height - 1;
+		supported[j] = found[r] || (r > 0 && found[r - 1]) || (r + 1 < coarse->height && found[r + 1]);
+	}
+}
+
+
+/*
+    Runs the gradients and NMS of one pyramid level, skipping the rows that are not
+    supported. G and dir are scratch planes of at least the size of the level.
+*/
+void pyramid_level(struct image_buffer *blurred, struct image_buffer *nms, float *G, png_bytep dir, bool *supported) {
+	const unsigned width = blurred->width;
+	const unsigned height = blurred->height;
+	//NMS reads the gradient of the border pixels, which is 0
+	memset(G, 0, (size_t) width * height * sizeof(float));
+
 	#pragma omp parallel for
-	for (int i = 1; i < width - 1; i++) {
-		for (int j = 1; j < height - 1; j++) {
-			int c = i + width * j;
-			int nn = c - width;
-			int ss = c + width;
-			int ww = c + 1;
-			int ee = c - 1;
-			int nw = nn + 1;
-			int ne = nn - 1;
-			int sw = ss + 1;
-			int se = ss - 1;
-			if ((dir[c] <= 1 || dir[c] > 7) && G[c] > G[ee] && G[c] > G[ww]) {
-				nms[j][i] = G[c];
-			} else if ((dir[c] > 1 && dir[c] <= 3) && G[c] > G[nw] && G[c] > G[se]) {
-				nms[j][i] = G[c];
-			} else if ((dir[c] > 3 && dir[c] <= 5) && G[c] > G[nn] && G[c] > G[ss]) {	
-				nms[j][i] = G[c];
-			} else if ((dir[c] > 5 && dir[c] <= 7) && G[c] > G[ne] && G[c] > G[sw]) {
-				nms[j][i] = G[c];
-			} else {
-				nms[j][i] = 0;
+	for (unsigned n = 1; n < height - 1; n++) {
+		if (supported[n - 1] || supported[n] || supported[n + 1]) {
+			png_bytep rows[3] = {blurred->data + (size_t) (n - 1) * blurred->stride, blurred->data + (size_t) n * blurred->stride, blurred->data + (size_t) (n + 1) * blurred->stride};
+			simd.gradient_row(rows, G + (size_t) n * width, dir + (size_t) n * width, width);
+		}
+	}
+	#pragma omp parallel for
+	for (unsigned j = 1; j < height - 1; j++) {
+		if (supported[j]) {
+			float *rows[3] = {G + (size_t) (j - 1) * width, G + (size_t) j * width, G + (size_t) (j + 1) * width};
+			simd.suppression_row(rows, dir + (size_t) j * width, nms->data + (size_t) j * nms->stride, width);
+		}
+	}
+}
+
+
+/*
+    Clears the responses of nms that have no response of at least tmin among the 3x3
+    pixels of coarse around their parent.
+*/
+void pyramid_gate(struct image_buffer *nms, struct image_buffer *coarse, const unsigned tmin) {
+	#pragma omp parallel for
+	for (unsigned j = 0; j < nms->height; j++) {
+		png_bytep row = nms->data + (size_t) j * nms->stride;
+		const unsigned r = j / 2 < coarse->height ? j / 2 : coarse->height - 1;
+		const unsigned above = r > 0 ? r - 1 : 0;
+		const unsigned below = r + 1 < coarse->height ? r + 1 : r;
+		for (unsigned i = 0; i < nms->width; i++) {
+			if (row[i] == 0) {
+				continue;
+			}
+			const unsigned c = i / 2 < coarse->width ? i / 2 : coarse->width - 1;
+			const unsigned left = c > 0 ? c - 1 : 0;
+			const unsigned right = c + 1 < coarse->width ? c + 1 : c;
+			bool kept = false;
+			for (unsigned y = above; y <= below && !kept; y++) {
+				png_bytep parents = coarse->data + (size_t) y * coarse->stride;
+				for (unsigned x = left; x <= right; x++) {
+					kept |= parents[x] >= tmin;
+				}
+			}
+			if (!kept) {
+				row[i] = 0;
 			}
 		}
 	}
 }
 
+
+/*
+    Cache blocked version of the first three steps for images too large to stream
+    through the cache once per step. The NMS output is cut into tiles of TILE_WIDTH by
+    TILE_HEIGHT pixels and each thread runs the gaussian filter, the intensity gradients
+    and the non maximum suppression for a tile plus the halo those steps need in a
+    small scratch area, so only the input and the NMS result go through memory.
+
+    The normalization of the gaussian filter depends on the range of the whole image,
+    so unless range already holds it a first pass finds that range without storing
+    anything. The scratch areas of the threads are allocated on the calling thread
+    before the tiles are handed out.
+*/
+void tiled_pipeline(struct image_buffer *input, struct image_buffer *nms, const float sigma, const bool fixed, const float *range) {
+	const unsigned width = input->width;
+	const unsigned height = input->height;
+	struct gaussian kernel;
+	gaussian_kernel(sigma, fixed, &kernel);
+	if (width < 3 || height < 3) {
+		return;
+	}
+	float min, max;
+	if (range != NULL) {
+		min = range[0];
+		max = range[1];
+	} else {
+		convolution_range(input, &kernel, &min, &max);
+	}
+
+	const unsigned tile_columns = (width - 2 + TILE_WIDTH - 1) / TILE_WIDTH;
+	const unsigned tile_rows = (height - 2 + TILE_HEIGHT - 1) / TILE_HEIGHT;
+	struct arena *arena = thread_arena();
+	const size_t mark = arena_mark(arena);
+	const unsigned max_threads = omp_get_max_threads();
+	struct tile_scratch scratch[max_threads];
+	for (unsigned t = 0; t < max_threads; t++) {
+		allocate_tile_scratch(&scratch[t], kernel.size, arena);
+	}
+	#pragma omp parallel num_threads(max_threads)
+	{
+		struct tile_scratch *own = &scratch[omp_get_thread_num()];
+		#pragma omp for schedule(dynamic)
+		for (unsigned t = 0; t < tile_columns * tile_rows; t++) {
+			const unsigned top = 1 + t / tile_columns * TILE_HEIGHT;
+			const unsigned left = 1 + t % tile_columns * TILE_WIDTH;
+			const unsigned bottom = top + TILE_HEIGHT < height - 1 ? top + TILE_HEIGHT : height - 1;
+			const unsigned right = left + TILE_WIDTH < width - 1 ? left + TILE_WIDTH : width - 1;
+			process_tile(input, nms, &kernel, min, max, top, bottom, left, right, own);
+		}
+	}
+	arena_release(arena, mark);
+}
+
+
+/*
+    Runs the first three steps for the NMS pixels in rows [top, bottom) and columns
+    [left, right). Every scratch plane starts at row top - 2 and column left - 2. The
+    gaussian output is needed two pixels past the tile on every side and the gradient
+    one pixel past it, and anything the whole image steps leave at 0 (the borders of
+    the image) is left at 0 here too.
+*/
+void process_tile(struct image_buffer *input, struct image_buffer *nms, struct gaussian *kernel, const float min, const float max, const unsigned top, const unsigned bottom, const unsigned left, const unsigned right, struct tile_scratch *scratch) {
+	const unsigned width = input->width;
+	const unsigned height = input->height;
+	const int z = kernel->size;
+	const int half = z / 2;
+	const unsigned scratch_width = TILE_WIDTH + 4;
+	memset(scratch->blur, 0, scratch_width * (TILE_HEIGHT + 4));
+	memset(scratch->G, 0, scratch_width * (TILE_HEIGHT + 4) * sizeof(float));
+
+	//Gaussian filter
+	const unsigned blur_top = top >= half + 2 ? top - 2 : half;
+	const unsigned blur_bottom = bottom + 2 < height - half ? bottom + 2 : height - half;
+	const unsigned blur_left = left >= half + 2 ? left - 2 : half;
+	const unsigned blur_right = right + 2 < width - half ? right + 2 : width - half;
+	if (blur_top < blur_bottom && blur_left < blur_right) {
+		const unsigned span = blur_right - blur_left + 2 * half;
+		const unsigned row_size = span * kernel->element;
+		png_bytep source = input->data + blur_left - half;
+		void *window[z];
+		for (unsigned row = blur_top - half; row < blur_top + half; row++) {
+			gaussian_pass_h(kernel, source + (size_t) row * input->stride, scratch->ring + (row % z) * row_size, span);
+		}
+		for (unsigned n = blur_top; n < blur_bottom; n++) {
+			gaussian_pass_h(kernel, source + (size_t) (n + half) * input->stride, scratch->ring + ((n + half) % z) * row_size, span);
+			for (int j = 0; j < z; j++) {
+				window[j] = scratch->ring + ((n + half - j) % z) * row_size;
+			}
+			gaussian_pass_v(kernel, window, scratch->row, span);
+			simd.normalize_row(scratch->row, scratch->blur + (n + 2 - top) * scratch_width + blur_left + 2 - left, blur_right - blur_left, min, max);
+		}
+	}
+
+	//Intensity gradients
+	const unsigned gradient_top = top > 1 ? top - 1 : 1;
+	const unsigned gradient_bottom = bottom + 1 < height - 1 ? bottom + 1 : height - 1;
+	const unsigned gradient_left = left > 1 ? left - 1 : 1;
+	const unsigned gradient_right = right + 1 < width - 1 ? right + 1 : width - 1;
+	for (unsigned n = gradient_top; n < gradient_bottom; n++) {
+		const unsigned offset = (n + 2 - top) * scratch_width + gradient_left + 1 - left;
+		png_bytep rows[3] = {scratch->blur + offset - scratch_width, scratch->blur + offset, scratch->blur + offset + scratch_width};
+		simd.gradient_row(rows, scratch->G + offset, scratch->dir + offset, gradient_right - gradient_left + 2);
+	}
+
+	//Non maximum suppression
+	for (unsigned n = top; n < bottom; n++) {
+		const unsigned offset = (n + 2 - top) * scratch_width + 1;
+		float *rows[3] = {scratch->G + offset - scratch_width, scratch->G + offset, scratch->G + offset + scratch_width};
+		simd.suppression_row(rows, scratch->dir + offset, nms->data + (size_t) n * nms->stride + left - 1, right - left + 2);
+	}
+}
+
+
+/*
+    Allocates the per thread scratch area of the tiled pipeline for a gaussian kernel
+    of size z in either precision from arena.
+*/
+void allocate_tile_scratch(struct tile_scratch *scratch, const int z, struct arena *arena) {
+	const unsigned scratch_width = TILE_WIDTH + 4;
+	scratch->blur = arena_alloc(arena, scratch_width * (TILE_HEIGHT + 4));
+	scratch->G = arena_alloc(arena, scratch_width * (TILE_HEIGHT + 4) * sizeof(float));
+	scratch->dir = arena_alloc(arena, scratch_width * (TILE_HEIGHT + 4));
+	scratch->ring = arena_alloc(arena, z * (scratch_width + z) * sizeof(float));
+	scratch->row = arena_alloc(arena, scratch_width * sizeof(float));
+}
+
+
+/*
+    Streaming version of the whole algorithm for images too tall to keep several copies
+    of in memory. The image is decoded row by row twice. The gaussian filter is
+    normalized with the min and max of the whole filtered image, so no row of it can be
+    finished before the last row has been decoded, and the first pass only finds that
+    range. Keeping the decoded image for the second pass instead would double the
+    memory this path exists to save. The second pass pushes every row through the
+    gaussian filter, the intensity gradients and the non maximum suppression, which
+    each keep a sliding window of the rows they need.
+
+    The memory is bounded by the NMS result, one byte per pixel of the full width by
+    height plane, plus what hysteresis needs next to it: 16 bytes per row and 17 per run
+    of candidate pixels, which is far less than the plane unless most rows are broken
+    into short runs. Hysteresis cannot start before the last row either, since an edge
+    can be connected to a strong pixel anywhere below it, so it runs in place on the NMS
+    result before it is written out row by row.
+*/
+void streaming_edge_detection(FILE *src_file, FILE *dst_file, png_structp *png_read_ptr, png_infop *read_info_ptr, png_infop *read_end_ptr, png_structp *png_write_ptr, png_infop *write_info_ptr, const struct canny_params *params, const bool fixed, struct arena *arena, struct mapped_file *source) {
+	const unsigned width = png_get_rowbytes(*png_read_ptr, *read_info_ptr);
+	const unsigned height = png_get_image_height(*png_read_ptr, *read_info_ptr);
+	struct gaussian kernel;
+	gaussian_kernel(params->sigma, fixed, &kernel);
+
+	float min, max;
+	streaming_range(*png_read_ptr, width, height, &kernel, &min, &max, NULL, 0, 0);
+
+	//Start decoding again from the top of the file
+	png_destroy_read_struct(png_read_ptr, read_info_ptr, read_end_ptr);
+	rewind(src_file);
+	source->offset = 0;
+	setup_read(src_file, dst_file, png_read_ptr, read_info_ptr, read_end_ptr, arena, source);
+	setup_info(*png_read_ptr, *read_info_ptr);
+
+	struct arena *scratch = thread_arena();
+	const size_t mark = arena_mark(scratch);
+	struct image_buffer nms;
+	allocate_image(&nms, width, height, scratch);
+	streaming_suppression(*png_read_ptr, &nms, &kernel, min, max);
+	png_read_end(*png_read_ptr, *read_end_ptr);
+
+	hysteresis(&nms, &nms, params->high, params->low);
+
+	setup_write(src_file, dst_file, *png_read_ptr, *read_info_ptr, *read_end_ptr, png_write_ptr, write_info_ptr, arena, options.encoding, options.one_bit);
+	execute_write_rows(*png_write_ptr, *write_info_ptr, nms.rows, height);
+	arena_release(scratch, mark);
+}
+
+
+/*
+    First pass of the streaming version. Decodes every row and finds the range of the
+    separable convolution the same way convolution_range does, keeping only the last z
+    horizontally filtered rows. Unless region is NULL the rows of the image it covers,
+    from column left of row top on, are copied into it on the way.
+*/
+void streaming_range(png_structp png_read_ptr, const unsigned width, const unsigned height, struct gaussian *kernel, float *range_min, float *range_max, struct image_buffer *region, const unsigned left, const unsigned top) {
+	const int z = kernel->size;
+	const int half = z / 2;
+	const unsigned row_size = width * kernel->element;
+	const bool filtered = width >= z && height >= z;
+	float min = FLT_MAX, max = -FLT_MAX;
+	struct arena *arena = thread_arena();
+	const size_t mark = arena_mark(arena);
+	png_bytep row = arena_calloc(arena, width * sizeof(png_byte));
+	png_bytep ring = arena_alloc(arena, z * row_size);
+	float *out = arena_alloc(arena, width * sizeof(float));
+	void *window[z];
+
+	for (unsigned r = 0; r < height; r++) {
+		png_read_row(png_read_ptr, row, NULL);
+		if (region != NULL && r >= top && r < top + region->height) {
+			memcpy(region->rows[r - top], row + left, region->width);
+		}
+		if (!filtered) {
+			continue;
+		}
+		gaussian_pass_h(kernel, row, ring + (r % z) * row_size, width);
+		if (r < z - 1) {
+			continue;
+		}
+		for (int j = 0; j < z; j++) {
+			window[j] = ring + ((r - j) % z) * row_size;
+		}
+		gaussian_pass_v(kernel, window, out, width);
+		simd.range_row(out, width - 2 * half, &min, &max);
+	}
+	arena_release(arena, mark);
+	*range_min = min;
+	*range_max = max;
+}
+
+
+/*
+    Second pass of the streaming version. Row n of the gaussian filter needs the input up
+    to row n + z / 2, row n - 1 of the gradient needs the gaussian rows up to n, and row
+    n - 2 of the NMS needs the gradient rows up to n - 1, so each step only keeps a ring
+    of the rows it reads and fills in the rows the whole image steps leave at 0.
+*/
+void streaming_suppression(png_structp png_read_ptr, struct image_buffer *nms, struct gaussian *kernel, const float min, const float max) {
+	const unsigned width = nms->width;
+	const unsigned height = nms->height;
+	const int z = kernel->size;
+	const int half = z / 2;
+	const unsigned row_size = width * kernel->element;
+	const bool filtered = width >= z && height >= z;
+	struct arena *arena = thread_arena();
+	const size_t mark = arena_mark(arena);
+	png_bytep row = arena_calloc(arena, width * sizeof(png_byte));
+	png_bytep ring = arena_alloc(arena, z * row_size);
+	float *pixels = arena_alloc(arena, width * sizeof(float));
+	png_bytep blur = arena_calloc(arena, 3 * width * sizeof(png_byte));
+	float *G = arena_calloc(arena, 3 * width * sizeof(float));
+	png_bytep dir = arena_calloc(arena, 3 * width * sizeof(png_byte));
+	void *window[z];
+	unsigned decoded = 0;
+
+	for (unsigned n = 0; n < height + 2; n++) {
+		//Gaussian filter for row n
+		png_bytep blurred = blur + (n % 3) * width;
+		if (filtered && n >= half && n < height - half) {
+			for (; decoded <= n + half; decoded++) {
+				png_read_row(png_read_ptr, row, NULL);
+				gaussian_pass_h(kernel, row, ring + (decoded % z) * row_size, width);
+			}
+			for (int j = 0; j < z; j++) {
+				window[j] = ring + ((n + half - j) % z) * row_size;
+			}
+			gaussian_pass_v(kernel, window, pixels, width);
+			simd.normalize_row(pixels, blurred + half, width - 2 * half, min, max);
+		} else if (n < height) {
+			memset(blurred, 0, width);
+		}
+		if (width < 3) {
+			continue;
+		}
+
+		//Intensity gradients for row n - 1
+		if (n >= 2 && n - 1 < height - 1) {
+			png_bytep rows[3] = {blur + ((n - 2) % 3) * width, blur + ((n - 1) % 3) * width, blurred};
+			simd.gradient_row(rows, G + ((n - 1) % 3) * width, dir + ((n - 1) % 3) * width, width);
+		} else if (n == height) {
+			memset(G + ((n - 1) % 3) * width, 0, width * sizeof(float));
+		}
+
+		//Non maximum suppression for row n - 2
+		if (n >= 3 && n - 2 < height - 1) {
+			float *rows[3] = {G + ((n - 3) % 3) * width, G + ((n - 2) % 3) * width, G + ((n - 1) % 3) * width};
+			simd.suppression_row(rows, dir + ((n - 2) % 3) * width, nms->data + (size_t) (n - 2) * nms->stride, width);
+		}
+	}
+	//Rows the gaussian filter did not need still have to be decoded
+	for (; decoded < height; decoded++) {
+		png_read_row(png_read_ptr, row, NULL);
+	}
+	arena_release(arena, mark);
+}
+
+
 /*
      Takes the pixel values in nms and determines if the values are greater than tmax or tmin.
      If the value is greater than tmax then the brightness of the pixel is set to be maximal.
      If the value is greater than min then it will be turned on if any of its neighbors have
      been set to be edges. The output results are written to out.
+
+     Put differently the edges are the 8-connected components of pixels of at least tmin
+     that contain a pixel of at least tmax. They are labeled with a union-find over the
+     horizontal runs of such pixels rather than over single pixels, see struct edge_runs,
+     in steps that each run on every thread without any rounds between them:
+
+     1. Count the runs of every band of rows so they can be stored without growing.
+
+     2. Store the runs of every band and join each run with the runs of the row above it
+        that it touches, inside the band.
+
+     3. Join the runs of the first row of every band with the ones they touch in the last
+        row of the band above. Joins of different threads can meet on the same root, so
+        union_runs links roots with a compare and swap.
+
+     4. Mark the root of every run that holds a pixel of at least tmax, then write out
+        every run whose root is marked. Every pixel of nms is read before this step so
+        out can be nms.
+
+     All the memory comes from the calling thread before the first parallel region, so
+     running out of it never happens on a worker thread.
 */
-void hysteresis(png_bytep *out, png_bytep *nms, const unsigned width, const unsigned height, const unsigned tmax, const unsigned tmin) {
-	int *edges = calloc(sizeof(int), width * height);
-
-	for (int i = 0; i < width; i++) {
-		for (int j = 0; j < height; j++) {
-			out[j][i] = 0;
-		}
-	}
-    
-	for (int j = 1; j < height - 1; j++) {
-		for (int i = 1; i < width - 1; i++) {
-			int c = i + width * j;
-			if (nms[c / width][c % width] >= tmax && out[c / width][c % width] == 0) {
-				out[c / width][c % width] = MAX_BRIGHTNESS;
-				int nedges = 1;
-				edges[0] = c;
-				do {
-					nedges--;
-					int t = edges[nedges];
- 
-					int nbs[8]; // neighbors
-					nbs[0] = t - width;     // nn
-					nbs[1] = t + width;     // ss
-					nbs[2] = t + 1;         // ww
-					nbs[3] = t - 1;         // ee
-					nbs[4] = nbs[0] + 1;    // nw
-					nbs[5] = nbs[0] - 1;    // ne
-					nbs[6] = nbs[1] + 1;    // sw
-					nbs[7] = nbs[1] - 1;    // se
- 
-					for (int k = 0; k < 8; k++) {
-						if (nms[nbs[k]/ width][nbs[k] % width] >= tmin && out[nbs[k]/ width][nbs[k] % width] == 0) {
-							out[nbs[k]/ width][nbs[k] % width] = MAX_BRIGHTNESS;
-							edges[nedges] = nbs[k];
-							nedges++;
-						}
+void hysteresis(struct image_buffer *out, struct image_buffer *nms, const unsigned tmax, const unsigned tmin) {
+	const unsigned width = nms->width;
+	const unsigned height = nms->height;
+	if (width < 3 || height < 3) {
+		memset(out->data, 0, (size_t) out->height * out->stride);
+		return;
+	}
+	const unsigned bands = omp_get_max_threads();
+	const unsigned band = (height - 2 + bands - 1) / bands;
+	struct arena *scratch = thread_arena();
+	const size_t mark = arena_mark(scratch);
+	size_t offsets[bands + 1];
+
+	#pragma omp parallel for schedule(static)
+	for (unsigned b = 0; b < bands; b++) {
+		const unsigned first = 1 + b * band < height - 1 ? 1 + b * band : height - 1;
+		const unsigned last = first + band < height - 1 ? first + band : height - 1;
+		size_t count = 0;
+		for (unsigned j = first; j < last; j++) {
+			png_bytep row = nms->data + (size_t) j * nms->stride;
+			for (unsigned i = 1; i < width - 1; i++) {
+				if (zero_bytes(row, i, width - 1, tmin)) {
+					i += 7;
+					continue;
+				}
+				count += row[i] >= tmin && (i == 1 || row[i - 1] < tmin);
+			}
+		}
+		offsets[b + 1] = count;
+	}
+	offsets[0] = 0;
+	for (unsigned b = 0; b < bands; b++) {
+		offsets[b + 1] += offsets[b];
+	}
+
+	struct edge_runs runs;
+	runs.start = arena_alloc(scratch, offsets[bands] * sizeof(unsigned));
+	runs.end = arena_alloc(scratch, offsets[bands] * sizeof(unsigned));
+	runs.parent = arena_alloc(scratch, offsets[bands] * sizeof(size_t));
+	runs.strong = arena_alloc(scratch, offsets[bands] * sizeof(unsigned char));
+	runs.first = arena_calloc(scratch, height * sizeof(size_t));
+	runs.last = arena_calloc(scratch, height * sizeof(size_t));
+
+	#pragma omp parallel
+	{
+		#pragma omp for schedule(static)
+		for (unsigned b = 0; b < bands; b++) {
+			const unsigned first = 1 + b * band < height - 1 ? 1 + b * band : height - 1;
+			const unsigned last = first + band < height - 1 ? first + band : height - 1;
+			size_t r = offsets[b];
+			for (unsigned j = first; j < last; j++) {
+				png_bytep row = nms->data + (size_t) j * nms->stride;
+				runs.first[j] = r;
+				for (unsigned i = 1; i < width - 1; i++) {
+					if (zero_bytes(row, i, width - 1, tmin)) {
+						i += 7;
+						continue;
 					}
-				} while (nedges > 0);
+					if (row[i] < tmin) {
+						continue;
+					}
+					runs.start[r] = i;
+					runs.parent[r] = r;
+					runs.strong[r] = false;
+					for (; i < width - 1 && row[i] >= tmin; i++) {
+						runs.strong[r] |= row[i] >= tmax;
+					}
+					runs.end[r++] = i;
+				}
+				runs.last[j] = r;
+				if (j > first) {
+					join_rows(&runs, j - 1, j);
+				}
+			}
+		}
+
+		#pragma omp for schedule(static)
+		for (unsigned b = 1; b < bands; b++) {
+			const unsigned first = 1 + b * band;
+			if (first < height - 1) {
+				join_rows(&runs, first - 1, first);
+			}
+		}
+
+		#pragma omp for schedule(static)
+		for (size_t r = 0; r < offsets[bands]; r++) {
+			if (__atomic_load_n(&runs.strong[r], __ATOMIC_RELAXED)) {
+				__atomic_store_n(&runs.strong[find_run(&runs, r)], true, __ATOMIC_RELAXED);
+			}
+		}
+
+		#pragma omp for schedule(static)
+		for (unsigned j = 0; j < height; j++) {
+			png_bytep edges = out->data + (size_t) j * out->stride;
+			memset(edges, 0, width);
+			for (size_t r = runs.first[j]; r < runs.last[j]; r++) {
+				if (runs.strong[find_run(&runs, r)]) {
+					memset(edges + runs.start[r], MAX_BRIGHTNESS, runs.end[r] - runs.start[r]);
+				}
 			}
 		}
 	}
-	free(edges);
+	arena_release(scratch, mark);
 }
 
 
 /*
-    Allocates the memory necessary to read from the png file. The png_ functions
-    all interact with the PNG_LIB library and should be used as opposed
-    to the traditional malloc. Note that a png_bytep * is used because to set the
-    rows to contain the data a value of type png_bytep * must be presented.
-    Also note a png_bytep is an unsigned char *
+    Returns true if the 8 pixels of row from column i on are before column end and all
+    0, so none of them can be a candidate for a tmin above 0. Most of an NMS result is
+    0, and this skips it a word at a time.
 */
-void allocate_read_mem(png_structp png_read_ptr, png_bytep *row_pointers, unsigned height, unsigned width) {
-	for (unsigned row = 0; row < height; row++) {
-		row_pointers[row] = NULL;
+bool zero_bytes(png_bytep row, const unsigned i, const unsigned end, const unsigned tmin) {
+	uint64_t word;
+	if (tmin == 0 || i + 8 > end) {
+		return false;
 	}
+	memcpy(&word, row + i, sizeof(word));
+	return word == 0;
+}
 
-	for (unsigned row = 0; row < height; row++) {
-		row_pointers[row] = png_malloc(png_read_ptr, width);
-		for (int j = 0; j < width; j++) {
-			row_pointers[row][j] = 0;
+
+/*
+    Joins every run of row j with the runs of row k = j - 1 it touches, which for
+    8-connectivity are the ones that overlap it after growing it a pixel on each side.
+    Both rows are sorted by column so one pass over each is enough.
+*/
+void join_rows(struct edge_runs *runs, const unsigned k, const unsigned j) {
+	size_t above = runs->first[k];
+	for (size_t r = runs->first[j]; r < runs->last[j]; r++) {
+		while (above < runs->last[k] && runs->end[above] < runs->start[r]) {
+			above++;
+		}
+		for (size_t a = above; a < runs->last[k] && runs->start[a] <= runs->end[r]; a++) {
+			union_runs(runs, a, r);
 		}
 	}
 }
 
 
 /*
-    Allocates the memory necessary to perform all of the steps of the edge detection algorithm.
-    The png_ functions all interact with the PNG_LIB library and should be used as opposed to 
-    the traditional malloc. Note that a png_bytep * is used because on must be final type for 
-    rows presented to be written must be a png_bytep *. Also note a png_bytep is an unsigned char *
+    Returns the root of the component of run r. Every step points the run it passes at
+    its grandparent, which is still in the same component, so later finds are shorter.
 */
-void allocate_write_mem(png_structp png_write_ptr, png_bytep *rows1, png_bytep *rows2, png_bytep *rows3, png_bytep *rows4, png_bytep *rows5, unsigned height, unsigned width) {
-	for (unsigned row = 0; row < height; row++) {
-		rows1[row] = NULL;
-		rows2[row] = NULL;
-		rows3[row] = NULL;
-		rows4[row] = NULL;
-		rows5[row] = NULL;
+size_t find_run(struct edge_runs *runs, size_t r) {
+	size_t parent = __atomic_load_n(&runs->parent[r], __ATOMIC_RELAXED);
+	while (parent != r) {
+		const size_t grandparent = __atomic_load_n(&runs->parent[parent], __ATOMIC_RELAXED);
+		__atomic_store_n(&runs->parent[r], grandparent, __ATOMIC_RELAXED);
+		r = parent;
+		parent = grandparent;
 	}
-	for (unsigned row = 0; row < height; row++) {
-		rows1[row] = png_malloc(png_write_ptr, width);
-		rows2[row] = png_malloc(png_write_ptr, width);
-		rows3[row] = png_malloc(png_write_ptr, width);
-		rows4[row] = png_malloc(png_write_ptr, width);
-		rows5[row] = png_malloc(png_write_ptr, width);
-		for (int j = 0; j < width; j++) {
-			rows1[row][j] = 0;
-			rows2[row][j] = 0;
-			rows3[row][j] = 0;
-			rows4[row][j] = 0;
-			rows5[row][j] = 0;
+	return r;
+}
+
+
+/*
+    Joins the components of runs a and b. The root with the larger index is linked to
+    the other one with a compare and swap that fails if another thread linked it first,
+    in which case the roots are looked up again. Links only ever point to smaller
+    indices, so there are no cycles.
+*/
+void union_runs(struct edge_runs *runs, size_t a, size_t b) {
+	while (true) {
+		a = find_run(runs, a);
+		b = find_run(runs, b);
+		if (a == b) {
+			return;
+		}
+		if (a < b) {
+			const size_t swap = a;
+			a = b;
+			b = swap;
+		}
+		size_t expected = a;
+		if (__atomic_compare_exchange_n(&runs->parent[a], &expected, b, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			return;
 		}
 	}
 }
 
+
 /*
-    Frees all of the memory allocated to hold the png information. The png_
-    functions are all functions that interact with the PNG_LIB library and should
-    be used as opposed to the traditional free.
+    Allocates an image from arena as one zeroed block of rows. The stride is rounded up
+    so every row starts on an IMAGE_ALIGNMENT byte boundary. The stages index the block
+    as flat memory and the rows view is what gets handed to PNG_LIB, which expects a
+    png_bytep * with HEIGHT rows.
 */
-void cleanup_rows(png_structp png_write_ptr, png_bytep *rows1, png_bytep *rows2, png_bytep *rows3, png_bytep *rows4, png_bytep *rows5, png_structp png_read_ptr, png_bytep *readrows, unsigned height) {
+void allocate_image(struct image_buffer *image, const unsigned width, const unsigned height, struct arena *arena) {
+	image->width = width;
+	image->height = height;
+	image->stride = (width + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+	image->data = arena_calloc(arena, (size_t) image->stride * height);
+	image->rows = arena_alloc(arena, height * sizeof(png_bytep));
 	for (unsigned row = 0; row < height; row++) {
-		png_free(png_write_ptr, rows1[row]);
-		png_free(png_write_ptr, rows2[row]);
-		png_free(png_write_ptr, rows3[row]);
-		png_free(png_write_ptr, rows4[row]);
-		png_free(png_write_ptr, rows5[row]);
-		png_free(png_read_ptr, readrows[row]);
+		image->rows[row] = image->data + (size_t) row * image->stride;
+	}
+}
+
+
+/*
+    Closes the files of an image that failed partway through the stages and empties the
+    arena of its job, which also frees the PNG_LIB structs. job->src_file and
+    job->dst_file are NULL for files that are not open.
+*/
+void abandon_image(struct canny_job *job) {
+	unmap_file(&job->source);
+	if (job->src_file != NULL) {
+		fclose(job->src_file);
+		job->src_file = NULL;
+	}
+	if (job->dst_file != NULL) {
+		fclose(job->dst_file);
+		job->dst_file = NULL;
+	}
+	arena_release(&job->arena, 0);
+}
+
+
+/*
+    Makes view the width by height part of image starting at column x of row y. It
+    shares the pixels and the stride of image and only has rows of its own.
+*/
+void view_image(struct image_buffer *view, struct image_buffer *image, const unsigned x, const unsigned y, const unsigned width, const unsigned height, struct arena *arena) {
+	view->width = width;
+	view->height = height;
+	view->stride = image->stride;
+	view->data = image->data + (size_t) y * image->stride + x;
+	view->rows = arena_alloc(arena, height * sizeof(png_bytep));
+	for (unsigned row = 0; row < height; row++) {
+		view->rows[row] = view->data + (size_t) row * view->stride;
 	}
 }
 
@@ -524,9 +1595,265 @@ void cleanup_rows(png_structp png_write_ptr, png_bytep *rows1, png_bytep *rows2,
 /*
     Function responsible for initiating the edge detection program on 1 or more png images.
     This function is the first location in which processing begins.
+
+    The images are sorted from largest to smallest using the sizes in their headers. The
+    images of at least BATCH_SHARED_MIN_PIXELS pixels have enough rows to keep every thread
+    busy, so they run one after another with the parallel loops inside each step, and are
+    pipelined so the next one is decoded and the previous one encoded while one computes.
+    With a single thread or a single image every image goes this way, and a single image
+    is not probed so that it can also come from a pipe. The smaller images then run
+    concurrently, one per thread, and the dynamic schedule hands the next image to
+    whichever thread finishes first so the smallest ones fill in the tail.
+
+    The jobs are created once for the whole batch, enough for the pipeline and for one
+    per thread, and together with the scratch arenas of the threads they keep their
+    memory from image to image. Once they have seen the largest image the batch stops
+    allocating.
 */
-void handle_batch(char **src_values, char **dst_values, unsigned count) {
-	for (int i = 0; i < count; i++) {
-		canny_edge_detection(src_values[i], dst_values[i]);
+void handle_batch(char **src_values, char **dst_values, unsigned count, unsigned queue_depth) {
+	struct batch_image *images = malloc(count * sizeof(struct batch_image));
+	for (unsigned i = 0; i < count; i++) {
+		images[i].src = src_values[i];
+		images[i].dst = dst_values[i];
+		images[i].pixels = count > 1 ? probe_pixels(src_values[i]) : 0;
 	}
+	qsort(images, count, sizeof(struct batch_image), compare_batch_images);
+
+	unsigned shared = 0;
+	const bool single = omp_get_max_threads() == 1 || count == 1;
+	while (shared < count && (single || images[shared].pixels >= BATCH_SHARED_MIN_PIXELS)) {
+		shared++;
+	}
+	struct canny_context context;
+	const unsigned threads = omp_get_max_threads();
+	context_init(&context, 2 * queue_depth + 3 > threads ? 2 * queue_depth + 3 : threads);
+
+	pipeline_batch(images, shared, queue_depth, &context);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (unsigned i = shared; i < count; i++) {
+		canny_edge_detection(images[i].src, images[i].dst, &options.roi, &options.params, &context.jobs[omp_get_thread_num()]);
+	}
+	context_destroy(&context);
+	free(images);
+}
+
+
+/*
+    Creates the count jobs of a batch, all of them idle and without memory yet.
+*/
+void context_init(struct canny_context *context, const unsigned count) {
+	context->jobs = calloc(count, sizeof(struct canny_job));
+	if (context->jobs == NULL) {
+		fprintf(stderr, "Failed to allocate space for the batch.\n");
+		exit(1);
+	}
+	context->count = count;
+	queue_init(&context->idle, count);
+	for (unsigned i = 0; i < count; i++) {
+		queue_push(&context->idle, &context->jobs[i]);
+	}
+}
+
+
+/*
+    Frees the jobs of a batch together with the scratch arenas of the OpenMP threads and
+    of the calling thread.
+*/
+void context_destroy(struct canny_context *context) {
+	for (unsigned i = 0; i < context->count; i++) {
+		arena_destroy(&context->jobs[i].arena);
+	}
+	queue_destroy(&context->idle);
+	free(context->jobs);
+	#pragma omp parallel
+	arena_destroy(thread_arena());
+}
+
+
+/*
+    Runs the three stages of canny_edge_detection over count images on three threads, a
+    decoder, the calling thread for the compute and an encoder. The stages hand images to
+    each other through queues of queue_depth images, so at most about twice that many
+    images are in memory at once. A queue depth of 0 runs the images one at a time. The
+    decoder takes the job of each image from the idle jobs of context and the encoder
+    gives it back.
+*/
+void pipeline_batch(struct batch_image *images, const unsigned count, const unsigned queue_depth, struct canny_context *context) {
+	if (queue_depth == 0 || count < 2) {
+		for (unsigned i = 0; i < count; i++) {
+			canny_edge_detection(images[i].src, images[i].dst, &options.roi, &options.params, &context->jobs[0]);
+		}
+		return;
+	}
+	struct batch_pipeline pipeline;
+	pipeline.images = images;
+	pipeline.count = count;
+	pipeline.context = context;
+	queue_init(&pipeline.decoded, queue_depth);
+	queue_init(&pipeline.computed, queue_depth);
+	pthread_t decoder, encoder;
+	if (pthread_create(&decoder, NULL, decode_stage, &pipeline) || pthread_create(&encoder, NULL, encode_stage, &pipeline)) {
+		fprintf(stderr, "Failed to start the batch pipeline.\n");
+		exit(1);
+	}
+
+	struct canny_job *job;
+	while ((job = queue_pop(&pipeline.decoded)) != NULL) {
+		compute_image(job);
+		queue_push(&pipeline.computed, job);
+	}
+	queue_close(&pipeline.computed);
+
+	pthread_join(decoder, NULL);
+	pthread_join(encoder, NULL);
+	queue_destroy(&pipeline.decoded);
+	queue_destroy(&pipeline.computed);
+}
+
+
+/*
+    Thread of the batch pipeline that decodes the images in order. The scratch arena of
+    the thread is freed before it ends, since nothing else would.
+*/
+void *decode_stage(void *arg) {
+	struct batch_pipeline *pipeline = arg;
+	for (unsigned i = 0; i < pipeline->count; i++) {
+		struct canny_job *job = queue_pop(&pipeline->context->idle);
+		decode_image(job, pipeline->images[i].src, pipeline->images[i].dst, &options.roi, &options.params);
+		queue_push(&pipeline->decoded, job);
+	}
+	queue_close(&pipeline->decoded);
+	arena_destroy(thread_arena());
+	return NULL;
+}
+
+
+/*
+    Thread of the batch pipeline that encodes the computed images, which also frees its
+    scratch arena before it ends.
+*/
+void *encode_stage(void *arg) {
+	struct batch_pipeline *pipeline = arg;
+	struct canny_job *job;
+	while ((job = queue_pop(&pipeline->computed)) != NULL) {
+		encode_image(job);
+		queue_push(&pipeline->context->idle, job);
+	}
+	arena_destroy(thread_arena());
+	return NULL;
+}
+
+
+/*
+    Sets up an empty queue that holds at most capacity jobs.
+*/
+void queue_init(struct job_queue *queue, const unsigned capacity) {
+	queue->jobs = malloc(capacity * sizeof(struct canny_job *));
+	if (queue->jobs == NULL) {
+		fprintf(stderr, "Failed to allocate space for the batch pipeline.\n");
+		exit(1);
+	}
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->closed = false;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+}
+
+
+/*
+    Adds job to the back of the queue, waiting while the queue is full.
+*/
+void queue_push(struct job_queue *queue, struct canny_job *job) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->capacity) {
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	}
+	queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+
+/*
+    Takes the job at the front of the queue, waiting while the queue is empty. Returns
+    NULL once the queue is empty and closed.
+*/
+struct canny_job *queue_pop(struct job_queue *queue) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0 && !queue->closed) {
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+	struct canny_job *job = NULL;
+	if (queue->count > 0) {
+		job = queue->jobs[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return job;
+}
+
+
+/*
+    Marks that no more jobs will be pushed, which wakes up a waiting queue_pop.
+*/
+void queue_close(struct job_queue *queue) {
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = true;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+
+/*
+    Frees a queue set up with queue_init.
+*/
+void queue_destroy(struct job_queue *queue) {
+	free(queue->jobs);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+}
+
+
+/*
+    Returns the number of pixels of the file src from the IHDR chunk at the start of a
+    png file or the header of the other formats, without setting up a read. Files that cannot be probed count as empty and
+    report their error once they are actually read.
+
+    Every file of a batch is probed before the first one is decoded, so this is also
+    where the kernel is asked to start reading each of them in the background.
+*/
+size_t probe_pixels(char *src) {
+	png_byte header[RAW_HEADER_SIZE];
+	FILE *src_file = fopen(src, "rb");
+	if (src_file == NULL) {
+		return 0;
+	}
+	posix_fadvise(fileno(src_file), 0, 0, POSIX_FADV_WILLNEED);
+	size_t val = fread(header, 1, sizeof(header), src_file);
+	fclose(src_file);
+	const enum image_format format = image_format(src);
+	if (format != FORMAT_PNG) {
+		return probe_image(header, val, format);
+	}
+	if (val < 24 || png_sig_cmp(header, 0, 8) || memcmp(header + 12, "IHDR", 4)) {
+		return 0;
+	}
+	return (size_t) png_get_uint_32(header + 16) * png_get_uint_32(header + 20);
+}
+
+
+/*
+    Orders batch images from the most to the fewest pixels for qsort.
+*/
+int compare_batch_images(const void *a, const void *b) {
+	const size_t pixels_a = ((const struct batch_image *) a)->pixels;
+	const size_t pixels_b = ((const struct batch_image *) b)->pixels;
+	return (pixels_a < pixels_b) - (pixels_a > pixels_b);
 }
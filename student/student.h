@@ -1,19 +1,345 @@
-void canny_edge_detection(char *, char *);
+#define IMAGE_ALIGNMENT 64
 
-void gaussian_filter(png_bytep *, png_bytep *, const unsigned, const unsigned, const float);
+#define GAUSSIAN_MAX_SIZE 13
 
-void convolution(png_bytep *, png_bytep *, float *, const unsigned, const unsigned, const int, const bool);
+/*
+	The weights of the fixed point gaussian filter add up to 1 << GAUSSIAN_FIXED_BITS.
+	More bits would let a horizontally filtered pixel overflow a signed 16-bit value.
+*/
+#define GAUSSIAN_FIXED_BITS 7
 
-void intensity_gradients(png_bytep *, png_bytep *, png_bytep *, float *, float *, const unsigned, const unsigned);
+/*
+	Most kernels gaussian_kernel builds at run time and keeps for later images.
+*/
+#define GAUSSIAN_CACHE_SIZE 16
 
-void non_maximum_suppression(png_bytep *, float *, float *, const unsigned, const unsigned);
+/*
+	Most levels the multi-scale mode builds, the full image included.
+*/
+#define PYRAMID_MAX_LEVELS 5
 
-void hysteresis(png_bytep *, png_bytep *, const unsigned, const unsigned, const unsigned, const unsigned);
+/*
+	Hysteresis margin of a region of interest unless -r gives one.
+*/
+#define ROI_MARGIN 16
 
-void allocate_read_mem(png_structp, png_bytep *, unsigned, unsigned);
+/*
+	Pixels around a region of interest that its edges depend on through the kernels: the
+	largest gaussian kernel radius, one for the Sobel operator and one for NMS.
+*/
+#define ROI_HALO (GAUSSIAN_MAX_SIZE / 2 + 2)
 
-void allocate_write_mem(png_structp, png_bytep *, png_bytep *, png_bytep *, png_bytep *, png_bytep *, unsigned, unsigned);
+/*
+	Images with at least this many pixels go through the tiled pipeline. A tile and
+	its scratch area take roughly 100KB so they stay in the L2 cache.
+*/
+#define TILED_MIN_PIXELS (1 << 20)
+#define TILE_WIDTH 256
+#define TILE_HEIGHT 64
 
-void cleanup_rows(png_structp, png_bytep *, png_bytep *, png_bytep *, png_bytep *, png_bytep *, png_structp, png_bytep *, unsigned);
+/*
+	Non interlaced images with at least this many pixels are decoded and processed
+	row by row, so only the NMS result and the hysteresis state scale with the height.
+*/
+#define STREAMING_MIN_PIXELS (1 << 26)
 
-void handle_batch(char **s, char **, unsigned);
\ No newline at end of file
+/*
+	Batch images with at least this many pixels run one at a time with every thread,
+	smaller ones run concurrently with one thread each.
+*/
+#define BATCH_SHARED_MIN_PIXELS (1 << 20)
+
+/*
+	Images each queue of the batch pipeline holds unless -q says otherwise.
+*/
+#define BATCH_QUEUE_DEPTH 2
+
+/*
+	Largest depth -q accepts. Each image a queue holds keeps its decoded image and its
+	result in memory, and the batch runs 2 * depth + 3 jobs.
+*/
+#define BATCH_MAX_QUEUE_DEPTH 64
+
+/*
+	Direction sectors of the gradient, centered on 0, 45, 90 and 135 degrees.
+*/
+#define SECTOR_0 0
+#define SECTOR_45 1
+#define SECTOR_90 2
+#define SECTOR_135 3
+
+/*
+	An image stored as one contiguous block. Row n starts at data + n * stride and
+	rows holds the same pointers for the PNG_LIB read and write calls.
+*/
+struct image_buffer {
+	png_bytep data;
+	png_bytep *rows;
+	unsigned width;
+	unsigned height;
+	unsigned stride;
+};
+
+/*
+	Per thread scratch area of the tiled pipeline.
+*/
+struct tile_scratch {
+	png_bytep blur;
+	float *G;
+	png_bytep dir;
+	png_bytep ring;
+	float *row;
+};
+
+/*
+	Runs of hysteresis, the horizontal stretches of pixels of at least tmin. They are
+	stored row by row, row j holding the runs first[j] to last[j] - 1, and run r covers
+	columns start[r] to end[r] - 1. parent is the union-find forest of the runs and
+	strong marks the runs with a pixel of at least tmax and then the roots of their
+	components.
+*/
+struct edge_runs {
+	unsigned *start;
+	unsigned *end;
+	size_t *parent;
+	unsigned char *strong;
+	size_t *first;
+	size_t *last;
+};
+
+/*
+	A 1D gaussian kernel of size taps for sigma. weights is used by the float filter and
+	fixed_weights by the fixed point one, whose horizontal pass stores element bytes
+	per pixel instead of a float.
+*/
+struct gaussian {
+	float sigma;
+	int size;
+	bool fixed;
+	unsigned element;
+	float weights[GAUSSIAN_MAX_SIZE];
+	int16_t fixed_weights[GAUSSIAN_MAX_SIZE];
+};
+
+/*
+	A rectangle of an image to find the edges in. Hysteresis also runs over margin more
+	pixels on every side so edges that leave the rectangle and come back in are still
+	traced. A width of 0 stands for the whole image.
+*/
+struct canny_roi {
+	unsigned x;
+	unsigned y;
+	unsigned width;
+	unsigned height;
+	unsigned margin;
+};
+
+/*
+	Options that apply to every image of a run. pyramid_levels is the number of scales
+	of the multi-scale mode, 1 runs the single scale algorithm. roi is the rectangle
+	given with -r, encoding and one_bit are how the output is written and params are
+	the parameters of every image of a batch.
+*/
+struct canny_options {
+	bool fixed_point;
+	unsigned pyramid_levels;
+	struct canny_roi roi;
+	enum encode_profile encoding;
+	bool one_bit;
+	struct canny_params params;
+};
+
+extern struct canny_options options;
+
+/*
+	An image of a batch with the number of pixels read from its header.
+*/
+struct batch_image {
+	char *src;
+	char *dst;
+	size_t pixels;
+};
+
+/*
+	An image on its way through the three stages of canny_edge_detection. started is
+	the time the decode started at when profiling. arena holds the images and the
+	PNG_LIB structs of the current image and is reused by the next image of the job.
+	crop is where the region of interest lies within input, if there is one, and range
+	is then the range of the gaussian filter over the whole image, so the region is
+	normalized like a full run. source is the mapping the input file is read from.
+	source_format and target_format are the formats of the input and output files, and
+	the PNG_LIB structs stay NULL for the ones that are not PNG. params are the
+	parameters the image is processed with.
+*/
+struct canny_job {
+	FILE *src_file;
+	FILE *dst_file;
+	png_structp png_read_ptr;
+	png_infop read_info_ptr;
+	png_infop read_end_ptr;
+	png_structp png_write_ptr;
+	png_infop write_info_ptr;
+	struct image_buffer input;
+	struct image_buffer output;
+	bool streamed;
+	double started;
+	struct arena arena;
+	struct canny_roi crop;
+	float range[2];
+	struct mapped_file source;
+	enum image_format source_format;
+	enum image_format target_format;
+	struct canny_params params;
+};
+
+/*
+	A bounded queue of jobs between two stages of the batch pipeline.
+*/
+struct job_queue {
+	struct canny_job **jobs;
+	unsigned capacity;
+	unsigned head;
+	unsigned count;
+	bool closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+/*
+	The jobs of a batch, created once and reused for every image. idle holds the jobs
+	the batch pipeline is not using. A context of the library made by
+	canny_context_create only has the one job and no idle queue.
+*/
+struct canny_context {
+	struct canny_job *jobs;
+	unsigned count;
+	struct job_queue idle;
+};
+
+/*
+	State shared by the threads of the batch pipeline.
+*/
+struct batch_pipeline {
+	struct batch_image *images;
+	unsigned count;
+	struct canny_context *context;
+	struct job_queue decoded;
+	struct job_queue computed;
+};
+
+void canny_edge_detection(char *, char *, const struct canny_roi *, const struct canny_params *, struct canny_job *);
+
+void decode_image(struct canny_job *, char *, char *, const struct canny_roi *, const struct canny_params *);
+
+void decode_region(struct canny_job *, const struct canny_roi *, const unsigned, const unsigned);
+
+void compute_image(struct canny_job *);
+
+void encode_image(struct canny_job *);
+
+void abandon_image(struct canny_job *);
+
+void gaussian_filter(struct image_buffer *, struct image_buffer *, const float, const bool, const float *);
+
+void separable_convolution(struct image_buffer *, struct image_buffer *, struct gaussian *, const float *);
+
+void gaussian_kernel(const float, const bool, struct gaussian *);
+
+void build_gaussian_kernel(const float, struct gaussian *);
+
+void gaussian_pass_h(struct gaussian *, png_bytep, void *, const unsigned);
+
+void gaussian_pass_v(struct gaussian *, void **, float *, const unsigned);
+
+void convolution_range(struct image_buffer *, struct gaussian *, float *, float *);
+
+void convolution_band(struct image_buffer *, struct gaussian *, const unsigned, const unsigned, float *, const unsigned, float *, float *, png_bytep);
+
+void prefetch_row(png_bytep, const unsigned);
+
+void normalize_row(float *, png_bytep, const unsigned, const float, const float);
+
+void range_row(float *, const unsigned, float *, float *);
+
+void gaussian_row_h(png_bytep, float *, float *, const unsigned, const int);
+
+void gaussian_row_v(float **, float *, float *, const unsigned, const int);
+
+void gaussian_row_h_fixed(png_bytep, int16_t *, int16_t *, const unsigned, const int);
+
+void gaussian_row_v_fixed(int16_t **, float *, int16_t *, const unsigned, const int);
+
+void intensity_gradients(struct image_buffer *, float *, png_bytep);
+
+void gradient_row(png_bytep *, float *, png_bytep, const unsigned);
+
+png_byte gradient_sector(const int, const int);
+
+void non_maximum_suppression(struct image_buffer *, float *, png_bytep);
+
+void suppression_row(float **, png_bytep, png_bytep, const unsigned);
+
+png_byte suppress_pixel(float **, const png_byte, const unsigned);
+
+void pyramid_edge_detection(struct image_buffer *, struct image_buffer *, const float, const bool, const unsigned, const unsigned, const float *);
+
+void downsample_image(struct image_buffer *, struct image_buffer *);
+
+void pyramid_support(struct image_buffer *, bool *, const unsigned, const unsigned);
+
+void pyramid_level(struct image_buffer *, struct image_buffer *, float *, png_bytep, bool *);
+
+void pyramid_gate(struct image_buffer *, struct image_buffer *, const unsigned);
+
+void tiled_pipeline(struct image_buffer *, struct image_buffer *, const float, const bool, const float *);
+
+void process_tile(struct image_buffer *, struct image_buffer *, struct gaussian *, const float, const float, const unsigned, const unsigned, const unsigned, const unsigned, struct tile_scratch *);
+
+void allocate_tile_scratch(struct tile_scratch *, const int, struct arena *);
+
+void streaming_edge_detection(FILE *, FILE *, png_structp *, png_infop *, png_infop *, png_structp *, png_infop *, const struct canny_params *, const bool, struct arena *, struct mapped_file *);
+
+void streaming_range(png_structp, const unsigned, const unsigned, struct gaussian *, float *, float *, struct image_buffer *, const unsigned, const unsigned);
+
+void streaming_suppression(png_structp, struct image_buffer *, struct gaussian *, const float, const float);
+
+void hysteresis(struct image_buffer *, struct image_buffer *, const unsigned, const unsigned);
+
+bool zero_bytes(png_bytep, const unsigned, const unsigned, const unsigned);
+
+void join_rows(struct edge_runs *, const unsigned, const unsigned);
+
+size_t find_run(struct edge_runs *, size_t);
+
+void union_runs(struct edge_runs *, size_t, size_t);
+
+void allocate_image(struct image_buffer *, const unsigned, const unsigned, struct arena *);
+
+void view_image(struct image_buffer *, struct image_buffer *, const unsigned, const unsigned, const unsigned, const unsigned, struct arena *);
+
+void handle_batch(char **s, char **, unsigned, unsigned);
+
+void context_init(struct canny_context *, const unsigned);
+
+void context_destroy(struct canny_context *);
+
+void pipeline_batch(struct batch_image *, const unsigned, const unsigned, struct canny_context *);
+
+void *decode_stage(void *);
+
+void *encode_stage(void *);
+
+void queue_init(struct job_queue *, const unsigned);
+
+void queue_push(struct job_queue *, struct canny_job *);
+
+struct canny_job *queue_pop(struct job_queue *);
+
+void queue_close(struct job_queue *);
+
+void queue_destroy(struct job_queue *);
+
+size_t probe_pixels(char *);
+
+int compare_batch_images(const void *, const void *);